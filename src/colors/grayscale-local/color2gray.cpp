@@ -10,10 +10,14 @@ Color to grayscale conversion, uses envelopes formed with the STRESS approach
     to perform local color-difference preserving grayscale generation.
 
  STRESS, Spatio Temporal Retinex Envelope with Stochastic Sampling
+
+ Global mode uses contrast preserving decolorization of Lu, Xu and Jia
 */
-#include <QImage>
+#include "color2gray.h"
 #include <cmath>
-#include <ctime>
+#include <algorithm>
+#include <functional>
+#include <vector>
 
 inline float srgb_to_linear(float value)
 {
@@ -29,34 +33,112 @@ inline float linear_to_srgb(float value)
   return 12.92f * value;
 }
 
+/* vector of 4 floats, gcc compiles operations on it to SSE or NEON instructions.
+   Used for min/max of 4 samples at once, and for R, G, B of a pixel at once */
+typedef float float4 __attribute__((vector_size(16)));
+
+static inline float4 min4(float4 a, float4 b) { return a < b ? a : b; }
+static inline float4 max4(float4 a, float4 b) { return a > b ? a : b; }
+static inline float4 splat4(float val) { float4 v = {val, val, val, val}; return v; }
+
+/* Linear image, where R, G, B and alpha are stored in separate planes, so
+   that same channel of several sampled pixels can be loaded in a vector.
+   Each plane is stored as 32x32 tiles, pixels of a tile are contiguous in
+   memory. Samples taken around nearby pixels fall in fewer memory pages
+   and cache lines than in row-by-row layout, where a sample 300 rows away
+   is always in a different page.
+   Linear R, G, B are stored as 16 bit integers, enough to keep every 8 bit
+   sRGB level distinct, and alpha as 8 bit, only if the image has alpha.
+   So a pixel takes 6 or 7 bytes instead of 16 bytes for 4 floats.
+*/
+#define TILE_SHIFT 5
+#define TILE_SIZE  (1<<TILE_SHIFT)
+#define TILE_MASK  (TILE_SIZE-1)
+
+#define LINEAR_MAX 65535.0f
+
 class Image {
 public:
     int _width;
     int _height;
-    float *data;
-
-    Image(int width, int height) : _width(width), _height(height) {
-        data = (float*) malloc(width*height*4*sizeof(float));
+    int tiles_x;
+    int tiles_y;
+    void *data;
+    quint16 *plane[3];// R, G, B
+    uchar *alpha_plane;// NULL if image is opaque
+    int row_mask;// all bits set, unless only a band of rows is stored
+
+    Image(int width, int height, bool has_alpha) : _width(width), _height(height), row_mask(-1) {
+        tiles_x = (width + TILE_MASK) >> TILE_SHIFT;
+        tiles_y = (height + TILE_MASK) >> TILE_SHIFT;
+        size_t size = (size_t)tiles_x*tiles_y*TILE_SIZE*TILE_SIZE;
+        data = malloc(size*3*sizeof(quint16) + (has_alpha ? size : 0));
+        for (int c=0; c<3; c++)
+            plane[c] = (quint16*)data + c*size;
+        alpha_plane = has_alpha ? (uchar*)(plane[2] + size) : NULL;
     }
     // create linear image from QImage, format must be RGB32 or ARGB32
-    Image(QImage &image) : Image(image.width(), image.height()) {
+    Image(QImage &image) : Image(image.width(), image.height(), image.hasAlphaChannel()) {
+        loadRows(image, 0, _height);
+    }
+    /* Band of a large image, which keeps only the given number of rows (a
+       power of 2). Row y is stored in place of row y % rows, so rows which are
+       loaded later replace the rows which are no longer needed. A pixel is
+       accessed with the same index(x,y) as in the whole image.
+    */
+    Image(int width, int height, bool has_alpha, int rows) : Image(width, rows, has_alpha) {
+        _height = height;
+        row_mask = rows-1;
+    }
+    // convert rows first to last-1 of QImage to linear
+    void loadRows(QImage &image, int first, int last) {
         // create srgb to linear conversion table
-        float linear[256];
+        quint16 linear[256];
         for (int i=0; i<256; i++) {
-            linear[i] = srgb_to_linear(i/255.0f);
+            linear[i] = roundf(srgb_to_linear(i/255.0f) * LINEAR_MAX);
         }
-        float *pix = data;
-
-        for (int y=0; y<_height; y++)
+        #pragma omp parallel for
+        for (int y=first; y<last; y++)
         {
-            QRgb *row = (QRgb*) image.scanLine(y);
+            QRgb *row = (QRgb*) image.constScanLine(y);
             for (int x=0; x<_width; x++) {
                 int clr = row[x];
-                pix[0] = linear[qRed(clr)];
-                pix[1] = linear[qGreen(clr)];
-                pix[2] = linear[qBlue(clr)];
-                pix[3] = qAlpha(clr)/255.0f;
-                pix += 4;
+                int i = index(x,y);
+                plane[0][i] = linear[qRed(clr)];
+                plane[1][i] = linear[qGreen(clr)];
+                plane[2][i] = linear[qBlue(clr)];
+                if (alpha_plane)
+                    alpha_plane[i] = qAlpha(clr);
+            }
+        }
+    }
+    // downscale image by box filter, fully transparent pixels are not
+    // counted in average color, as they are ignored while sampling
+    Image(Image &src, int factor) : Image((src.width() + factor-1)/factor,
+                                          (src.height() + factor-1)/factor,
+                                          src.alpha_plane!=NULL) {
+        #pragma omp parallel for
+        for (int y=0; y<_height; y++)
+        {
+            for (int x=0; x<_width; x++) {
+                float4 sum = {0,0,0,0};
+                int alpha_sum = 0;
+                int count = 0, opaque = 0;
+                for (int v=y*factor; v<std::min((y+1)*factor, src.height()); v++) {
+                    for (int u=x*factor; u<std::min((x+1)*factor, src.width()); u++) {
+                        int k = src.index(u,v);
+                        count++;
+                        if (src.alpha(k) == 0)
+                            continue;
+                        sum += src.pixel(k);
+                        alpha_sum += src.alpha(k);
+                        opaque++;
+                    }
+                }
+                int i = index(x,y);
+                setPixel(i, opaque ? sum/(float)opaque : sum);
+                if (alpha_plane)
+                    alpha_plane[i] = alpha_sum/count;
             }
         }
     }
@@ -65,170 +147,487 @@ public:
     }
     int width() { return _width;}
     int height() { return _height;}
-    float* scanLine(int row)   { return data + 4*(_width*row); }
-    float* pixel(int x, int y) { return data + 4*(_width*y+x); }
+    int index(int x, int y) {
+        y &= row_mask;
+        int tile = (y >> TILE_SHIFT)*tiles_x + (x >> TILE_SHIFT);
+        return (tile << 2*TILE_SHIFT) | ((y & TILE_MASK) << TILE_SHIFT) | (x & TILE_MASK);
+    }
+    // R, G, B of pixel in a vector in range 0-1, last element is 0
+    float4 pixel(int i) {
+        float4 pix = {float(plane[0][i]), float(plane[1][i]), float(plane[2][i]), 0};
+        return pix * (1.0f/LINEAR_MAX);
+    }
+    void setPixel(int i, float4 pix) {
+        for (int c=0; c<3; c++)
+            plane[c][i] = std::min(std::max(pix[c], 0.0f), 1.0f) * LINEAR_MAX + 0.5f;
+    }
+    // alpha in range 0-255
+    int alpha(int i) { return alpha_plane ? alpha_plane[i] : 255; }
 };
 
 #define PI           3.141593f
-#define ANGLE_PRIME  95273 /* the lookuptables are sized as primes to ensure */
-#define RADIUS_PRIME 29537 /* as good as possible variation when using both */
-
-static float   lut_cos[ANGLE_PRIME];
-static float   lut_sin[ANGLE_PRIME];
-static float   radiuses[RADIUS_PRIME];
-static double  luts_computed = 0.0;
-static int     angle_no=0;
-static int     radius_no=0;
-
-/* compute lookuptables for the radial gamma */
-static void compute_luts(double rgamma)
+#define ANGLE_LUT_SIZE  4096 /* entries are picked by hashing, so the lookuptables */
+#define RADIUS_LUT_SIZE 4096 /* need not be large, and they stay in CPU cache */
+
+static float   lut_cos[ANGLE_LUT_SIZE];
+static float   lut_sin[ANGLE_LUT_SIZE];
+static float   radiuses[RADIUS_LUT_SIZE];
+/* Lookup table entries used for a sample are picked by hashing pixel position,
+   iteration and sample number, instead of taking next entries of the tables.
+   So each pixel can be processed independently, and the result does not depend
+   on the order of processing or number of threads.
+*/
+static inline quint64 mix64(quint64 z)
 {
-    if (luts_computed==rgamma)
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline quint64 pixel_hash(int x, int y, uint seed)
+{
+    return mix64((((quint64)y << 32) | (uint)x) ^ mix64(seed));
+}
+
+static inline quint64 sample_hash(quint64 pixel_hash, int iteration, int n)
+{
+    return mix64(pixel_hash + (((quint64)iteration << 32) | (uint)n));
+}
+
+static double  luts_rgamma = 0.0;
+static uint    luts_seed = 0;
+
+/* compute lookuptables for the radial gamma.
+   Random radiuses are generated with splitmix64 instead of rand(), so
+   that same seed gives same result on every run and every platform */
+static void compute_luts(double rgamma, uint seed)
+{
+    if (luts_rgamma==rgamma && luts_seed==seed)
         return;
-    luts_computed = rgamma;
+    luts_rgamma = rgamma;
+    luts_seed = seed;
 
     float golden_angle = PI * (3-sqrt(5.0)); /* http://en.wikipedia.org/wiki/Golden_angle */
     float angle = 0.0;
 
-    for (int i=0; i<ANGLE_PRIME; i++)
+    for (int i=0; i<ANGLE_LUT_SIZE; i++)
     {
         angle += golden_angle;
         lut_cos[i] = cos(angle);
         lut_sin[i] = sin(angle);
     }
-    srand((unsigned)time(0));
+    quint64 state = seed;
+
+    for (int i=0; i<RADIUS_LUT_SIZE; i++)
+    {
+        state += 0x9e3779b97f4a7c15ULL;
+        // 53 random bits to double in range [0,1)
+        double rand_val = (mix64(state) >> 11) * (1.0/9007199254740992.0);
+        radiuses[i] = pow(rand_val, rgamma);
+    }
+}
 
-    for (int i=0; i<RADIUS_PRIME; i++)
+// update min and max of each channel with 4 sampled pixels,
+// values are compared in integer range, without scaling to 0-1
+static inline void
+min_max4 (Image &image, const int *index, float4 *min, float4 *max)
+{
+    for (int c=0; c<3; c++)
     {
-        radiuses[i] = pow(rand()/(float)RAND_MAX, rgamma);
+        const quint16 *p = image.plane[c];
+        float4 val = {float(p[index[0]]), float(p[index[1]]), float(p[index[2]]), float(p[index[3]])};
+        min[c] = min4(min[c], val);
+        max[c] = max4(max[c], val);
     }
 }
 
+/* Each sample is taken at a random distance along a random direction from
+   the pixel. Samples falling outside the image, or on fully transparent
+   pixels, are drawn again, so that samples are spread over the part of the
+   sampling disc inside the image, same as drawing again until one falls
+   inside. But at most MAX_DRAWS*samples are drawn, so cost per pixel is
+   bounded near corners, or when radius is much larger than the image, and
+   fewer samples are used if they run out. Pixels whose sampling disc lies
+   within the image do not need the bounds check.
+*/
+#define MAX_DRAWS 8
+
 static inline void
 sample_min_max (Image &image,
                 int         x,
                 int         y,
-                float      *pixel,
+                quint64     hash,
+                int         iteration,
                 int         radius,
                 int         samples,//4
-                float      *min,
-                float      *max)
+                float4     &min,
+                float4     &max)
 {
-    float best_min[3];
-    float best_max[3];
+    float4 best_min[3];// each lane holds minimum of every 4th sample
+    float4 best_max[3];
     int width = image.width();
     int height = image.height();
+    int center = image.index(x,y);
+    int index[4];// samples waiting to be processed
+    int count = 0;
+    int valid = 0;// number of samples inside image and not transparent
+    // whole sampling disc is inside the image
+    bool inside = (x >= radius && y >= radius && x+radius < width && y+radius < height);
 
     for (int c=0; c<3; c++){
-        best_min[c] = pixel[c];
-        best_max[c] = pixel[c];
+        best_min[c] = splat4(float(image.plane[c][center]));
+        best_max[c] = best_min[c];
     }
 
-    for (int i=0; i<samples; i++) {
-        int u, v;
-        int angle;
-        float rmag;
-        int max_retries = samples;
-
-retry:/* if we've sampled outside the valid image area, we grab another
-        sample instead, this should potentially work better than
-        mirroring or extending with an abyss policy */
+    for (int n=0; n<MAX_DRAWS*samples && valid<samples; n++)
+    {
+        quint64 h = sample_hash(hash, iteration, n);
+        int angle = h & (ANGLE_LUT_SIZE-1);
+        float rmag = radiuses[(h >> 32) & (RADIUS_LUT_SIZE-1)] * radius;
 
-        angle = angle_no++;
-        rmag = radiuses[radius_no++] * radius;
+        int u = x + rmag * lut_cos[angle];
+        int v = y + rmag * lut_sin[angle];
 
-        if (angle_no>=ANGLE_PRIME)
-            angle_no=0;
-        if (radius_no>=RADIUS_PRIME)
-            radius_no=0;
+        if (not inside && (u<0 || u>=width || v<0 || v>=height))
+            continue;
 
-        u = x + rmag * lut_cos[angle];
-        v = y + rmag * lut_sin[angle];
+        int k = image.index(u,v);
 
-        if (u>=width ||
-            u<0 ||
-            v>=height ||
-            v<0)
+        if (image.alpha(k) > 0) /* ignore fully transparent pixels */
         {
-            goto retry;
-        }
-
-      {
-        pixel = image.pixel(u,v);
-
-        if (pixel[3] > 0) /* ignore fully transparent pixels */
-        {
-            for (int c=0; c<3; c++)
-            {
-                if (pixel[c] < best_min[c])
-                    best_min[c] = pixel[c];
-
-                if (pixel[c] > best_max[c])
-                    best_max[c] = pixel[c];
+            valid++;
+            index[count++] = k;
+            if (count==4) {
+                min_max4(image, index, best_min, best_max);
+                count = 0;
             }
         }
-        else {
-            max_retries--;
-            if (max_retries > 0)
-                goto retry;
-        }
-      }
+    }
+    if (count) {// fill remaining lanes with center pixel, it does not change min or max
+        for (int i=count; i<4; i++)
+            index[i] = center;
+        min_max4(image, index, best_min, best_max);
     }
     for (int c=0; c<3; c++) {
-        min[c] = best_min[c];
-        max[c] = best_max[c];
+        float4 lo = best_min[c];
+        float4 hi = best_max[c];
+        min[c] = std::min(std::min(lo[0], lo[1]), std::min(lo[2], lo[3]));
+        max[c] = std::max(std::max(hi[0], hi[1]), std::max(hi[2], hi[3]));
     }
+    min[3] = max[3] = 0;
+    min *= 1.0f/LINEAR_MAX;
+    max *= 1.0f/LINEAR_MAX;
 }
 
 
-static inline void
+// relative brightness of pixel between min and max, for R, G, B at once
+static inline float4
+relative_brightness_of (float4 pixel, float4 min, float4 range)
+{
+    const float4 zero = splat4(0);
+    return range > zero ? (pixel - min) / (range > zero ? range : 1.0f) : splat4(0.5f);
+}
+
+/* Relative brightness and range of each iteration are independent estimates,
+   and envelopes are computed from their means. In adaptive mode (tolerance
+   greater than 0), iterations stop early when standard error of the mean
+   min and max envelope is below tolerance for all channels. Relative
+   brightness alone does not converge in flat regions, where it is random,
+   so it is weighted by range, i.e variance of min and max of each iteration
+   is used. Variance is computed with Welford's running method.
+   Returns the number of iterations done.
+*/
+#define MIN_ITERATIONS 5
+
+static inline int
 compute_envelopes (Image &image, int x, int y,
                   int     radius,
                   int     samples,
                   int     iterations,
-                  float  *min_envelope,
-                  float  *max_envelope)
+                  uint    seed,
+                  float   tolerance,
+                  float4 &min_envelope,
+                  float4 &max_envelope)
 {
-    float  range_sum[4]               = {0,0,0,0};
-    float  relative_brightness_sum[4] = {0,0,0,0};
+    float4 range_sum               = splat4(0);
+    float4 relative_brightness_sum = splat4(0);
+    float4 min_mean = splat4(0), min_m2 = splat4(0);// m2 is sum of squared deviations
+    float4 max_mean = splat4(0), max_m2 = splat4(0);
 
-    float *pixel = image.pixel(x,y);
+    float4 pixel = image.pixel(image.index(x,y));
+    quint64 hash = pixel_hash(x, y, seed);
+    int n = 0;
 
-    for (int i=0; i<iterations; i++)
+    while (n < iterations)
     {
-        float min[3], max[3];
+        float4 min, max;
+
+        sample_min_max (image, x, y, hash, n, radius, samples, min, max);
+        n++;
+
+        // R, G, B channels are processed at once
+        float4 range = max - min;
+        float4 relative_brightness = relative_brightness_of(pixel, min, range);
+        relative_brightness_sum += relative_brightness;
+        range_sum += range;
+
+        if (tolerance > 0) {
+            float4 delta = min - min_mean;
+            min_mean += delta / (float)n;
+            min_m2 += delta * (min - min_mean);
+            delta = max - max_mean;
+            max_mean += delta / (float)n;
+            max_m2 += delta * (max - max_mean);
+
+            if (n >= MIN_ITERATIONS) {
+                // squared standard error of mean = variance/n
+                float4 error = max4(min_m2, max_m2) * (1.0f/(n*(n-1)));
+                if (std::max(std::max(error[0], error[1]), error[2]) < tolerance*tolerance)
+                    break;
+            }
+        }
+    }
 
-        // sadly, this function can not be run in parallel, because radius_no
-        // and angle_no used in this function depends on previous value.
-        sample_min_max (image, x, y, pixel, radius, samples, min, max);
+    float4 relative_brightness = relative_brightness_sum / (float)n;
+    float4 range               = range_sum / (float)n;
 
-        for (int c=0; c<3; c++)
-        {
-            float range, relative_brightness;
+    max_envelope = pixel + (1.0f - relative_brightness) * range;
 
-            range = max[c] - min[c];
+    min_envelope = pixel - relative_brightness * range;
+    return n;
+}
 
-            if (range > 0.0) {
-                relative_brightness = (pixel[c] - min[c]) / range;
-            }
-            else {
-                relative_brightness = 0.5;
-            }
+/* Joint bilateral upsampling of envelopes computed on downscaled image.
+   Envelopes of the 4 nearest low resolution pixels are weighted by distance,
+   and by similarity of their color with the full resolution pixel, so that
+   envelope of one side of an edge does not leak to the other side.
+*/
+#define UPSAMPLE_SIGMA 0.1f /* color difference in linear RGB */
 
-            relative_brightness_sum[c] += relative_brightness;
-            range_sum[c] += range;
+static inline void
+upsample_envelopes (Image &small, Image &min_img, Image &max_img, int factor,
+                    int x, int y, float4 pixel, float4 &min, float4 &max)
+{
+    float fx = (x + 0.5f)/factor - 0.5f;
+    float fy = (y + 0.5f)/factor - 0.5f;
+    int x0 = floorf(fx);
+    int y0 = floorf(fy);
+    float ax = fx - x0;
+    float ay = fy - y0;
+    float4 min_sum = splat4(0);
+    float4 max_sum = splat4(0);
+    float weight_sum = 0;
+
+    for (int j=0; j<2; j++) {
+        for (int i=0; i<2; i++) {
+            int u = std::min(std::max(x0+i, 0), small.width()-1);
+            int v = std::min(std::max(y0+j, 0), small.height()-1);
+            int k = small.index(u,v);
+            if (small.alpha(k) == 0)
+                continue;
+            float4 diff = pixel - small.pixel(k);
+            diff *= diff;
+            float color_dist = diff[0] + diff[1] + diff[2];
+            float spatial = (i ? ax : 1-ax) * (j ? ay : 1-ay);
+            // when all neighbours differ a lot, it falls back to bilinear
+            float weight = spatial * (expf(-color_dist/(2*UPSAMPLE_SIGMA*UPSAMPLE_SIGMA)) + 1e-4f);
+            min_sum += weight * min_img.pixel(k);
+            max_sum += weight * max_img.pixel(k);
+            weight_sum += weight;
         }
     }
+    if (weight_sum > 0) {
+        // the envelopes must enclose the pixel itself
+        min = min4(min_sum / weight_sum, pixel);
+        max = max4(max_sum / weight_sum, pixel);
+    }
+    else {
+        min = max = pixel;
+    }
+}
 
-    for (int c=0; c<3; c++)
+// gray value of a pixel from its envelopes
+static inline int
+project_gray (float4 pixel, float4 min, float4 max, bool enhance_shadows)
+{
+    /* this should be replaced with a better/faster projection of
+     * pixel onto the vector spanned by min -> max, currently
+     * computed by comparing the distance to min with the sum
+     * of the distance to min/max.
+     */
+    float4 to_min = enhance_shadows ? pixel - min : pixel;
+    float4 to_max = pixel - max;
+    to_min *= to_min;
+    to_max *= to_max;
+
+    float nominator = sqrtf (to_min[0] + to_min[1] + to_min[2]);
+    float denominator = sqrtf (to_max[0] + to_max[1] + to_max[2]);
+    denominator = nominator + denominator;
+
+    int val = 187;
+    if (denominator>0.0f) {
+        val = 255 * linear_to_srgb(nominator/denominator);
+    }
+    return val;
+}
+
+/* ************** Exact Envelopes ***************
+   Instead of random sampling, envelopes can be computed as exact minimum and
+   maximum of each channel in a square window of side 2*radius+1, smoothed by
+   a box filter. It has no noise, and cost does not depend on radius.
+   Min and max filters are separable, applied on rows then on columns, and
+   each line is processed with van Herk/Gil-Werman algorithm, which needs 3
+   comparisons per pixel for any window size. An octagonal window would need
+   two more passes along diagonals, square window is used for simplicity.
+*/
+struct MinOp { quint16 operator()(quint16 a, quint16 b) const { return a < b ? a : b; } };
+struct MaxOp { quint16 operator()(quint16 a, quint16 b) const { return a > b ? a : b; } };
+
+// min or max of every window in a line. The line is divided into blocks of
+// window size, and running min/max from start and from end of each block are
+// computed. Then any window is the suffix of one block and prefix of next.
+// input line has len values, output has len-2*radius values
+template <typename Op>
+static void
+running_extremum (const quint16 *in, int len, int radius,
+                  quint16 *prefix, quint16 *suffix, quint16 *out, Op op)
+{
+    int window = 2*radius+1;
+    for (int start=0; start<len; start+=window) {
+        int end = std::min(start+window, len);
+        prefix[start] = in[start];
+        for (int i=start+1; i<end; i++)
+            prefix[i] = op(prefix[i-1], in[i]);
+        suffix[end-1] = in[end-1];
+        for (int i=end-2; i>=start; i--)
+            suffix[i] = op(suffix[i+1], in[i]);
+    }
+    for (int i=0; i+window<=len; i++)
+        out[i] = op(suffix[i], prefix[i+window-1]);
+}
+
+// filter each row (or column if vertical) of min and max planes in place
+static void
+min_max_filter (quint16 *min_plane, quint16 *max_plane, int w, int h, int radius, bool vertical)
+{
+    int count = vertical ? w : h;
+    int len = vertical ? h : w;
+    size_t stride = vertical ? w : 1;
+    size_t step = vertical ? 1 : w;
+    int padded_len = len + 2*radius;
+
+    #pragma omp parallel
+    {
+        quint16 *buff = (quint16*) malloc(padded_len*3*sizeof(quint16));
+        quint16 *in = buff;
+        quint16 *prefix = buff + padded_len;
+        quint16 *suffix = buff + 2*padded_len;
+
+        #pragma omp for
+        for (int l=0; l<count; l++)
+        {
+            for (int pass=0; pass<2; pass++) {
+                quint16 *line = (pass ? max_plane : min_plane) + l*step;
+                // pixels outside the image do not change min or max
+                quint16 pad = pass ? 0 : 65535;
+                for (int i=0; i<radius; i++)
+                    in[i] = in[radius+len+i] = pad;
+                for (int i=0; i<len; i++)
+                    in[radius+i] = line[i*stride];
+                // output is written over the input line, as it is already copied
+                if (pass)
+                    running_extremum(in, padded_len, radius, prefix, suffix, in, MaxOp());
+                else
+                    running_extremum(in, padded_len, radius, prefix, suffix, in, MinOp());
+                for (int i=0; i<len; i++)
+                    line[i*stride] = in[i];
+            }
+        }
+        free(buff);
+    }
+}
+
+// box blur each row (or column if vertical) in place, using cumulative sum,
+// near the borders only pixels inside the image are averaged
+static void
+box_filter (quint16 *plane, int w, int h, int radius, bool vertical)
+{
+    int count = vertical ? w : h;
+    int len = vertical ? h : w;
+    size_t stride = vertical ? w : 1;
+    size_t step = vertical ? 1 : w;
+
+    #pragma omp parallel
     {
-        float relative_brightness = relative_brightness_sum[c] / iterations;
-        float range               = range_sum[c] / iterations;
+        quint64 *sum = (quint64*) malloc((len+1)*sizeof(quint64));
+
+        #pragma omp for
+        for (int l=0; l<count; l++)
+        {
+            quint16 *line = plane + l*step;
+            sum[0] = 0;
+            for (int i=0; i<len; i++)
+                sum[i+1] = sum[i] + line[i*stride];
+            for (int i=0; i<len; i++) {
+                int start = std::max(i-radius, 0);
+                int end = std::min(i+radius+1, len);
+                line[i*stride] = (sum[end] - sum[start] + (end-start)/2) / (end-start);
+            }
+        }
+        free(sum);
+    }
+}
 
-        max_envelope[c] = pixel[c] + (1.0 - relative_brightness) * range;
+static void
+compute_exact_envelopes (Image &img, int radius, Image &min_img, Image &max_img)
+{
+    int w = img.width();
+    int h = img.height();
+    quint16 *min_plane = (quint16*) malloc((size_t)w*h*sizeof(quint16));
+    quint16 *max_plane = (quint16*) malloc((size_t)w*h*sizeof(quint16));
+    // smoothing removes the blocky look of square windows
+    int smooth_radius = std::max(radius/2, 1);
 
-        min_envelope[c] = pixel[c] - relative_brightness * range;
+    for (int c=0; c<3; c++)
+    {
+        // fully transparent pixels do not take part in min or max
+        #pragma omp parallel for
+        for (int y=0; y<h; y++) {
+            for (int x=0; x<w; x++) {
+                int i = img.index(x,y);
+                bool transparent = img.alpha(i)==0;
+                min_plane[y*w+x] = transparent ? 65535 : img.plane[c][i];
+                max_plane[y*w+x] = transparent ? 0 : img.plane[c][i];
+            }
+        }
+        min_max_filter(min_plane, max_plane, w, h, radius, false);
+        min_max_filter(min_plane, max_plane, w, h, radius, true);
+
+        #pragma omp parallel for
+        for (int y=0; y<h; y++) {
+            for (int x=0; x<w; x++) {
+                int i = img.index(x,y);
+                size_t j = (size_t)y*w + x;
+                if (min_plane[j] > max_plane[j])// whole window is transparent
+                    min_plane[j] = max_plane[j] = img.plane[c][i];
+            }
+        }
+        box_filter(min_plane, w, h, smooth_radius, false);
+        box_filter(min_plane, w, h, smooth_radius, true);
+        box_filter(max_plane, w, h, smooth_radius, false);
+        box_filter(max_plane, w, h, smooth_radius, true);
+
+        #pragma omp parallel for
+        for (int y=0; y<h; y++) {
+            for (int x=0; x<w; x++) {
+                int i = img.index(x,y);
+                min_img.plane[c][i] = min_plane[y*w+x];
+                max_img.plane[c][i] = max_plane[y*w+x];
+            }
+        }
     }
+    free(min_plane);
+    free(max_plane);
 }
 
 // Gamma applied to radial distribution
@@ -240,64 +639,366 @@ Radius -> Neighborhood taken into account, this is the radius in pixels taken
 Samples -> Number of samples to do per iteration looking for the range of colors
 Iterations -> Number of iterations, a higher number of iterations
         provides less noisy results at a computational cost
+options -> seed, downsample, tolerance, exact mode, see color2gray.h
 */
 QImage
-color2gray (QImage &image, int radius, int samples, int iterations, bool enhance_shadows)
+color2gray (QImage &image, int radius, int samples, int iterations, bool enhance_shadows,
+            const Color2GrayOptions &options)
 {
     int w = image.width();
     int h = image.height();
     QImage dstImg(w, h, image.format());
+    uint seed = options.seed;
+    int downsample = options.downsample;
+    float tolerance = options.tolerance;
+    bool exact = options.exact;
+
+    /* Banded mode, when radius is small compared to image height, process one
+       row of tiles at a time, keeping only the rows within radius of it in
+       linear image. Memory then depends on width x radius, not image area */
+    int band_rows = TILE_SIZE;
+    while (band_rows < 2*radius + TILE_SIZE)
+        band_rows *= 2;
+    bool banded = (not exact and downsample <= 1 and 2*band_rows <= h);
 
     // create linear image buffer
-    Image img(image);
+    Image *img = banded ? new Image(w, h, image.hasAlphaChannel(), band_rows)
+                        : new Image(image);
+
+    compute_luts(RGAMMA, seed);
+
+    double total_iterations = 0;
+    // in fast mode, compute envelopes on downscaled image
+    Image *small = NULL;
+    Image *min_img = NULL;
+    Image *max_img = NULL;
+    if (exact) {
+        min_img = new Image(w, h, false);
+        max_img = new Image(w, h, false);
+        compute_exact_envelopes(*img, radius, *min_img, *max_img);
+    }
+    else if (downsample > 1) {
+        small = new Image(*img, downsample);
+        min_img = new Image(small->width(), small->height(), false);
+        max_img = new Image(small->width(), small->height(), false);
+        int small_radius = std::max(radius/downsample, 1);
+        int tile_count = small->tiles_x * small->tiles_y;
+
+        #pragma omp parallel for schedule(dynamic) reduction(+:total_iterations)
+        for (int tile=0; tile < tile_count; tile++)
+        {
+            int left = (tile % small->tiles_x) * TILE_SIZE;
+            int top = (tile / small->tiles_x) * TILE_SIZE;
+            int right = std::min(left + TILE_SIZE, small->width());
+            int bottom = std::min(top + TILE_SIZE, small->height());
+
+            for (int y=top; y < bottom; y++) {
+                for (int x=left; x < right; x++) {
+                    float4 min, max;
+                    total_iterations += compute_envelopes (*small, x, y,
+                                     small_radius, samples, iterations, seed, tolerance,
+                                     min, max);
+                    int i = small->index(x,y);
+                    min_img->setPixel(i, min);
+                    max_img->setPixel(i, max);
+                }
+            }
+        }
+    }
 
-    compute_luts(RGAMMA);
+    uchar *dst_bits = dstImg.bits();
+    int bpl = dstImg.bytesPerLine();
+    int tiles_x = (w + TILE_MASK) >> TILE_SHIFT;
+    int tile_count = tiles_x * ((h + TILE_MASK) >> TILE_SHIFT);
+    int band_tiles = banded ? tiles_x : tile_count;
+    int loaded_rows = 0;
 
-    for (int y=0; y < h; y++)
+    for (int band=0; band < tile_count; band += band_tiles)
     {
-        QRgb *dst_row = (QRgb*) dstImg.scanLine(y);
-        for (int x=0; x < w; x++)
+        if (banded) {// load rows upto radius below this band
+            int last = std::min((band/tiles_x + 1)*TILE_SIZE + radius, h);
+            img->loadRows(image, loaded_rows, last);
+            loaded_rows = last;
+        }
+        // process in same order as pixels are stored, tile by tile
+        #pragma omp parallel for schedule(dynamic) reduction(+:total_iterations)
+        for (int tile=band; tile < band + band_tiles; tile++)
         {
-            float *pixel = img.pixel(x,y);
-            float  min[4], max[4];
+            int left = (tile % tiles_x) * TILE_SIZE;
+            int top = (tile / tiles_x) * TILE_SIZE;
+            int right = std::min(left + TILE_SIZE, w);
+            int bottom = std::min(top + TILE_SIZE, h);
 
-            compute_envelopes (img, x, y,
-                             radius, samples, iterations,
-                             min, max);
+            for (int y=top; y < bottom; y++)
             {
-            /* this should be replaced with a better/faster projection of
-             * pixel onto the vector spanned by min -> max, currently
-             * computed by comparing the distance to min with the sum
-             * of the distance to min/max.
-             */
-            float nominator = 0;
-            float denominator = 0;
-
-            if (enhance_shadows) {
-                for (int c=0; c<3; c++) {
-                    nominator   += (pixel[c] - min[c]) * (pixel[c] - min[c]);
-                    denominator += (pixel[c] - max[c]) * (pixel[c] - max[c]);
+                QRgb *dst_row = (QRgb*) (dst_bits + y*bpl);
+                for (int x=left; x < right; x++)
+                {
+                    int i = img->index(x,y);
+                    float4 pixel = img->pixel(i);
+                    float4 min, max;
+
+                    if (exact) {// the envelopes must enclose the pixel itself
+                        min = min4(min_img->pixel(i), pixel);
+                        max = max4(max_img->pixel(i), pixel);
+                    }
+                    else if (small)
+                        upsample_envelopes (*small, *min_img, *max_img, downsample,
+                                            x, y, pixel, min, max);
+                    else
+                        total_iterations += compute_envelopes (*img, x, y,
+                                         radius, samples, iterations, seed, tolerance,
+                                         min, max);
+
+                    int val = project_gray(pixel, min, max, enhance_shadows);
+                    dst_row[x] = qRgba(val, val, val, img->alpha(i));
                 }
             }
-            else {
-                for (int c=0; c<3; c++) {
-                    nominator   += pixel[c] * pixel[c];
-                    denominator += (pixel[c] - max[c]) * (pixel[c] - max[c]);
+        }
+    }
+    if (options.avg_iterations) {
+        double pixel_count = small ? double(small->width())*small->height() : double(w)*h;
+        *options.avg_iterations = total_iterations/pixel_count;
+    }
+    delete img;
+    delete small;
+    delete min_img;
+    delete max_img;
+    return dstImg;
+}
+
+/* Progressive color2gray, runs iterations one after another over the whole
+   image, keeping sum of relative brightness and range of every pixel, so that
+   the result can be shown after each iteration. As samples depend only on
+   pixel position, iteration and seed, result after n iterations is same as
+   that of color2gray() with n iterations. Used for live preview of a small
+   image, as the sums take 24 bytes per pixel.
+   callback receives result and number of iterations done, and returns false
+   to stop. Returns number of iterations done.
+*/
+int
+color2gray_progressive (QImage &image, int radius, int samples, int iterations,
+                        bool enhance_shadows, uint seed,
+                        std::function<bool(QImage&, int)> callback)
+{
+    int w = image.width();
+    int h = image.height();
+    QImage dstImg(w, h, image.format());
+
+    Image img(image);
+
+    compute_luts(RGAMMA, seed);
+
+    size_t size = (size_t)img.tiles_x*img.tiles_y*TILE_SIZE*TILE_SIZE;
+    float *sums = (float*) calloc(size*6, sizeof(float));// 3 channels each
+    float *relative_brightness_sums = sums;
+    float *range_sums = sums + size*3;
+    uchar *dst_bits = dstImg.bits();
+    int bpl = dstImg.bytesPerLine();
+    int tile_count = img.tiles_x * img.tiles_y;
+    int n = 0;
+
+    while (n < iterations)
+    {
+        #pragma omp parallel for schedule(dynamic)
+        for (int tile=0; tile < tile_count; tile++)
+        {
+            int left = (tile % img.tiles_x) * TILE_SIZE;
+            int top = (tile / img.tiles_x) * TILE_SIZE;
+            int right = std::min(left + TILE_SIZE, w);
+            int bottom = std::min(top + TILE_SIZE, h);
+
+            for (int y=top; y < bottom; y++)
+            {
+                QRgb *dst_row = (QRgb*) (dst_bits + y*bpl);
+                for (int x=left; x < right; x++)
+                {
+                    int i = img.index(x,y);
+                    float4 pixel = img.pixel(i);
+                    float4 min, max;
+
+                    sample_min_max (img, x, y, pixel_hash(x, y, seed), n,
+                                    radius, samples, min, max);
+                    float4 range = max - min;
+                    float4 relative_brightness = relative_brightness_of(pixel, min, range);
+
+                    float *rb_sum = relative_brightness_sums + 3*i;
+                    float *range_sum = range_sums + 3*i;
+                    for (int c=0; c<3; c++) {
+                        rb_sum[c] += relative_brightness[c];
+                        range_sum[c] += range[c];
+                        relative_brightness[c] = rb_sum[c] / (float)(n+1);
+                        range[c] = range_sum[c] / (float)(n+1);
+                    }
+                    relative_brightness[3] = range[3] = 0;
+                    max = pixel + (1.0f - relative_brightness) * range;
+                    min = pixel - relative_brightness * range;
+
+                    int val = project_gray(pixel, min, max, enhance_shadows);
+                    dst_row[x] = qRgba(val, val, val, img.alpha(i));
                 }
             }
+        }
+        n++;
+        if (not callback(dstImg, n))
+            break;
+    }
+    free(sums);
+    return n;
+}
+
+// ****************** Global Decolorization *******************
+/* Contrast preserving decolorization of Lu, Xu and Jia (2012), real-time version.
+   Gray is a weighted sum of linear R, G, B, with nonnegative weights which sum
+   to 1. Among the 66 such weights in steps of 0.1, the one is chosen for which
+   lightness differences of gray best match color differences of pixel pairs.
+   The pairs are taken from the image shrunk to about 64x64, between neighbours
+   and between randomly chosen pixels. Much faster than local methods, but two
+   colors always map to same gray values anywhere in the image.
+*/
+#define GLOBAL_SIZE     64    /* size of image from which pairs are taken */
+#define GLOBAL_SIGMA    0.05f /* tolerance of lightness difference */
+#define GLOBAL_MIN_DIFF 0.05f /* pairs of nearly same color are ignored */
+
+static inline float lab_f(float t)
+{
+    return t > 0.008856f ? cbrtf(t) : 7.787f*t + 16.0f/116;
+}
+
+// CIE L*a*b* (D65) of linear RGB, scaled to 0-1 range of L, instead of 0-100
+static float4 linear_to_lab(float4 rgb)
+{
+    float fx = lab_f((0.4124f*rgb[0] + 0.3576f*rgb[1] + 0.1805f*rgb[2]) / 0.95047f);
+    float fy = lab_f( 0.2126f*rgb[0] + 0.7152f*rgb[1] + 0.0722f*rgb[2]);
+    float fz = lab_f((0.0193f*rgb[0] + 0.1192f*rgb[1] + 0.9505f*rgb[2]) / 1.08883f);
+    float4 lab = {1.16f*fy - 0.16f, 5.0f*(fx - fy), 2.0f*(fy - fz), 0};
+    return lab;
+}
+
+/* Returns the weights of R, G, B which preserve the contrast best.
+   Energy of a weight is -sum(log(G(dg-d) + G(dg+d))) over all pairs, where d is
+   color difference, dg is lightness difference of gray and G is gaussian.
+   So a pair can become lighter or darker, but its contrast should be kept.
+*/
+static void
+decolorize_weights (QImage &image, uint seed, float weights[3])
+{
+    QImage thumb = image;
+    if (image.width() > GLOBAL_SIZE or image.height() > GLOBAL_SIZE)// original colors are kept
+        thumb = image.scaled(GLOBAL_SIZE, GLOBAL_SIZE, Qt::KeepAspectRatio, Qt::FastTransformation);
+    Image small(thumb);
+    int w = small.width();
+    int h = small.height();
+
+    // pairs of opaque pixels, and their color differences
+    std::vector<float4> pixels;
+    std::vector<int> pixel_id(w*h, -1);
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            int i = small.index(x,y);
+            if (small.alpha(i) < 128)
+                continue;
+            pixel_id[y*w+x] = pixels.size();
+            pixels.push_back(small.pixel(i));
+        }
+    }
+    int n = pixels.size();
+    std::vector<int> pairs;
+    std::vector<float> deltas;
+    auto add_pair = [&](int a, int b) {
+        if (a < 0 or b < 0)
+            return;
+        float4 diff = linear_to_lab(pixels[a]) - linear_to_lab(pixels[b]);
+        float delta = sqrtf(diff[0]*diff[0] + diff[1]*diff[1] + diff[2]*diff[2]);
+        if (delta < GLOBAL_MIN_DIFF)
+            return;
+        pairs.push_back(a);
+        pairs.push_back(b);
+        deltas.push_back(delta);
+    };
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            if (x+1 < w) add_pair(pixel_id[y*w+x], pixel_id[y*w+x+1]);
+            if (y+1 < h) add_pair(pixel_id[y*w+x], pixel_id[(y+1)*w+x]);
+        }
+    }
+    for (int i=0; i<n; i++) {
+        add_pair(i, mix64(((quint64)seed << 32) | i) % n);
+    }
 
-            nominator = sqrtf (nominator);
-            denominator = sqrtf (denominator);
-            denominator = nominator + denominator;
+    weights[0] = 0.2126f; weights[1] = 0.7152f; weights[2] = 0.0722f;
+    if (deltas.empty())// image has only few colors close to each other
+        return;
 
-            int val = 187;
-            if (denominator>0.0f) {
-                val = 255 * linear_to_srgb(nominator/denominator);
+    std::vector<float> lightness(n);
+    double min_energy = INFINITY;
+    for (int r=0; r<=10; r++) {
+        for (int g=0; g<=10-r; g++) {
+            float4 wt = {r/10.0f, g/10.0f, (10-r-g)/10.0f, 0};
+            for (int i=0; i<n; i++) {
+                float4 val = pixels[i] * wt;
+                lightness[i] = 1.16f*lab_f(val[0] + val[1] + val[2]) - 0.16f;
+            }
+            double energy = 0;
+            for (size_t k=0; k < deltas.size(); k++) {
+                float dg = lightness[pairs[2*k]] - lightness[pairs[2*k+1]];
+                float d1 = (dg - deltas[k]) * (dg - deltas[k]);
+                float d2 = (dg + deltas[k]) * (dg + deltas[k]);
+                // log(exp(-d1/2s²) + exp(-d2/2s²)), without underflow
+                float lo = std::min(d1, d2), hi = std::max(d1, d2);
+                energy += lo/(2*GLOBAL_SIGMA*GLOBAL_SIGMA)
+                        - log1pf(expf(-(hi-lo)/(2*GLOBAL_SIGMA*GLOBAL_SIGMA)));
             }
-            dst_row[x] = qRgba(val, val, val, pixel[3]*255);
+            if (energy < min_energy) {
+                min_energy = energy;
+                for (int c=0; c<3; c++)
+                    weights[c] = wt[c];
             }
         }
     }
-    return dstImg;
 }
 
+/* Global color to grayscale conversion.
+Seed -> Seed for choosing random pixel pairs
+weights -> if not NULL, weights of R, G, B used are stored in it
+*/
+QImage
+color2gray_global (QImage &image, uint seed, float *weights)
+{
+    int w = image.width();
+    int h = image.height();
+    QImage dstImg(w, h, image.format());
+
+    float wt[3];
+    decolorize_weights(image, seed, wt);
+    if (weights) {
+        for (int c=0; c<3; c++)
+            weights[c] = wt[c];
+    }
+    // weighted linear values in 16 bit fixed point, rounded down so that
+    // sum of three never exceeds LINEAR_MAX
+    int weighted[3][256];
+    for (int i=0; i<256; i++) {
+        float linear = srgb_to_linear(i/255.0f);
+        for (int c=0; c<3; c++)
+            weighted[c][i] = wt[c] * linear * LINEAR_MAX;
+    }
+    uchar *gray = (uchar*) malloc(LINEAR_MAX+1);
+    for (int i=0; i<=LINEAR_MAX; i++) {
+        gray[i] = linear_to_srgb(i/LINEAR_MAX) * 255 + 0.5f;
+    }
+
+    #pragma omp parallel for
+    for (int y=0; y<h; y++)
+    {
+        QRgb *row = (QRgb*) image.constScanLine(y);
+        QRgb *dst_row = (QRgb*) dstImg.scanLine(y);
+        for (int x=0; x<w; x++) {
+            QRgb clr = row[x];
+            int val = gray[weighted[0][qRed(clr)] + weighted[1][qGreen(clr)] + weighted[2][qBlue(clr)]];
+            dst_row[x] = qRgba(val, val, val, qAlpha(clr));
+        }
+    }
+    free(gray);
+    return dstImg;
+}
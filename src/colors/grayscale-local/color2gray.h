@@ -0,0 +1,27 @@
+#pragma once
+/* Color to grayscale conversion functions, implemented in color2gray.cpp */
+#include <QImage>
+#include <functional>
+
+// tuning options of color2gray(), defaults give plain STRESS result
+typedef struct Color2GrayOptions {
+    // Seed for random sampling, same seed gives same result
+    uint seed = 0;
+    // If more than 1, envelopes are computed on image downscaled by this
+    // factor and upsampled, which is about factor^2 times faster
+    int downsample = 1;
+    // If more than 0, iterations of a pixel stop when its envelopes are
+    // estimated within this tolerance, iterations is then the maximum
+    float tolerance = 0;
+    // Use exact min/max in square window as envelopes, instead of random
+    // sampling. samples, iterations, seed, downsample and tolerance are unused
+    bool exact = false;
+    // if not NULL, average number of iterations done is stored in it
+    float *avg_iterations = NULL;
+} Color2GrayOptions;
+
+QImage color2gray(QImage &image, int radius, int samples, int iterations, bool enhance_shadows,
+                  const Color2GrayOptions &options = Color2GrayOptions());
+int color2gray_progressive(QImage &image, int radius, int samples, int iterations,
+                  bool enhance_shadows, uint seed, std::function<bool(QImage&, int)> callback);
+QImage color2gray_global(QImage &image, uint seed, float *weights);
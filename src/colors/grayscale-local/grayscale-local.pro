@@ -1,4 +1,4 @@
-HEADERS = grayscale_local.h
+HEADERS = grayscale_local.h color2gray.h
 SOURCES = grayscale_local.cpp color2gray.cpp
 
 TARGET  = $$qtLibraryTarget(grayscale-local)
@@ -7,9 +7,9 @@ INCLUDEPATH += $$DESTDIR
 
 TEMPLATE        = lib
 CONFIG         += plugin
-QMAKE_CXXFLAGS  = -std=c++11
+QMAKE_CXXFLAGS  = -std=c++11 -fopenmp
 QMAKE_LFLAGS   += -s
-LIBS           +=
+LIBS           += -lgomp
 
 QT += widgets
 
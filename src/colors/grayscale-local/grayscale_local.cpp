@@ -5,10 +5,14 @@
     to perform local color-difference preserving grayscale generation.
 */
 #include "grayscale_local.h"
+#include "color2gray.h"
 #include <QDebug>
 #include <QGridLayout>
 #include <QLabel>
 #include <QDialogButtonBox>
+#include <QApplication>
+#include <QPixmap>
+#include <functional>
 
 #define PLUGIN_NAME "GrayScale (Local)"
 #define PLUGIN_VERSION "1.0"
@@ -17,8 +21,6 @@
     Q_EXPORT_PLUGIN2(grayscale-local, FilterPlugin);
 #endif
 
-QImage color2gray(QImage &image, int radius, int samples, int iterations, bool enhance_shadows);
-
 QString
 FilterPlugin:: menuItem()
 {
@@ -28,18 +30,41 @@ FilterPlugin:: menuItem()
 void
 FilterPlugin:: onMenuClick()
 {
-    GrayScaleDialog *dlg = new GrayScaleDialog(data->window);
+    GrayScaleDialog *dlg = new GrayScaleDialog(data->window, data->image);
     if (dlg->exec()==QDialog::Accepted) {
+        if (dlg->methodCombo->currentIndex()==METHOD_GLOBAL) {
+            float weights[3];
+            data->image = color2gray_global(data->image, dlg->seedSpin->value(), weights);
+            emit imageChanged();
+            emit sendNotification(PLUGIN_NAME, QString("Weights R, G, B : %1, %2, %3").arg(
+                        weights[0], 0, 'f', 1).arg(weights[1], 0, 'f', 1).arg(weights[2], 0, 'f', 1));
+            return;
+        }
+        Color2GrayOptions options;
+        float avg_iterations;
+        options.seed = dlg->seedSpin->value();
+        options.downsample = dlg->downsampleSpin->value();
+        options.tolerance = dlg->toleranceSpin->value();
+        options.exact = (dlg->methodCombo->currentIndex()==METHOD_EXACT);
+        options.avg_iterations = &avg_iterations;
         data->image = color2gray (data->image, dlg->radiusSpin->value(),
                                                 dlg->samplesSpin->value(),
-                                                dlg->iterationsSpin->value(),
-                                                dlg->enhanceShadowsBtn->isChecked());
+                                                dlg->iterations(),
+                                                dlg->enhanceShadowsBtn->isChecked(),
+                                                options);
         emit imageChanged();
+        if (options.tolerance > 0 and not options.exact)
+            emit sendNotification(PLUGIN_NAME, QString("Average iterations : %1").arg(avg_iterations, 0, 'f', 1));
     }
 }
 
 // **************** Input Options Dialog ******************
 // descriptions for tooltip
+#define METHOD_DESC "Random Sampling : envelopes from random samples around each pixel (STRESS)\n"\
+                    "Exact Min/Max : envelopes from exact min and max in square window,\n"\
+                    "      smoothed. Noise free and faster for large radius\n"\
+                    "Global : same weights of R, G, B for whole image, chosen to preserve\n"\
+                    "      contrast between colors. Fastest, but no local enhancement"
 #define RADIUS_DESC "Neighborhood taken into account, this is the radius \n"\
                      "in pixels taken into account when deciding which \n"\
                      "colors map to which gray values"
@@ -47,56 +72,212 @@ FilterPlugin:: onMenuClick()
 #define ITERATIONS_DESC "Number of iterations, a higher number of iterations \n"\
                      "provides less noisy results at a computational cost"
 #define ENHANCE_SHADOWS_DESC "When enabled details in shadows are boosted at the expense of noise"
+#define SEED_DESC "Seed for random sampling, same seed always gives same result"
+#define TOLERANCE_DESC "Adaptive mode, stop iterations of a pixel when its envelopes are\n"\
+                     "estimated within this tolerance. Iterations is then the maximum"
+#define PREVIEW_DESC "Show result on a small copy of the image, refined after every iteration.\n"\
+                     "Press Ok before it finishes to use the iterations done so far"
+#define DOWNSAMPLE_DESC "Fast mode, compute envelopes on image downscaled by this factor.\n"\
+                     "Speeds up about factor x factor times, useful for large radius"
 
-GrayScaleDialog:: GrayScaleDialog(QWidget *parent) : QDialog(parent)
+GrayScaleDialog:: GrayScaleDialog(QWidget *parent, QImage &img) : QDialog(parent), image(img)
 {
     this->setWindowTitle(PLUGIN_NAME);
-    this->resize(320, 184);
+    this->resize(340, 330);
 
     QGridLayout *gridLayout = new QGridLayout(this);
 
+    QLabel *label_0 = new QLabel("Method :", this);
+    gridLayout->addWidget(label_0, 0, 0, 1, 1);
+
+    methodCombo = new QComboBox(this);
+    methodCombo->addItems(QStringList() << "Random Sampling" << "Exact Min/Max" << "Global");
+    gridLayout->addWidget(methodCombo, 0, 1, 1, 1);
+
     QLabel *label = new QLabel("Radius :", this);
-    gridLayout->addWidget(label, 0, 0, 1, 1);
+    gridLayout->addWidget(label, 1, 0, 1, 1);
 
     radiusSpin = new QSpinBox(this);
     radiusSpin->setAlignment(Qt::AlignCenter);
     radiusSpin->setRange(2, 1000);
     radiusSpin->setValue(300);
-    gridLayout->addWidget(radiusSpin, 0, 1, 1, 1);
+    gridLayout->addWidget(radiusSpin, 1, 1, 1, 1);
 
     QLabel *label_2 = new QLabel("Samples :", this);
-    gridLayout->addWidget(label_2, 1, 0, 1, 1);
+    gridLayout->addWidget(label_2, 2, 0, 1, 1);
 
     samplesSpin = new QSpinBox(this);
     samplesSpin->setAlignment(Qt::AlignCenter);
     samplesSpin->setRange(3, 17);
     samplesSpin->setValue(4);
-    gridLayout->addWidget(samplesSpin, 1, 1, 1, 1);
+    gridLayout->addWidget(samplesSpin, 2, 1, 1, 1);
 
     QLabel *label_3 = new QLabel("Iterations :", this);
-    gridLayout->addWidget(label_3, 2, 0, 1, 1);
+    gridLayout->addWidget(label_3, 3, 0, 1, 1);
 
     iterationsSpin = new QSpinBox(this);
     iterationsSpin->setAlignment(Qt::AlignCenter);
     iterationsSpin->setRange(1, 30);
     iterationsSpin->setValue(10);
-    gridLayout->addWidget(iterationsSpin, 2, 1, 1, 1);
+    gridLayout->addWidget(iterationsSpin, 3, 1, 1, 1);
+
+    QLabel *label_4 = new QLabel("Tolerance :", this);
+    gridLayout->addWidget(label_4, 4, 0, 1, 1);
+
+    toleranceSpin = new QDoubleSpinBox(this);
+    toleranceSpin->setAlignment(Qt::AlignCenter);
+    toleranceSpin->setDecimals(3);
+    toleranceSpin->setSingleStep(0.005);
+    toleranceSpin->setRange(0.0, 0.1);
+    toleranceSpin->setValue(0.0);
+    toleranceSpin->setSpecialValueText("Off");
+    gridLayout->addWidget(toleranceSpin, 4, 1, 1, 1);
+
+    QLabel *label_5 = new QLabel("Seed :", this);
+    gridLayout->addWidget(label_5, 5, 0, 1, 1);
+
+    seedSpin = new QSpinBox(this);
+    seedSpin->setAlignment(Qt::AlignCenter);
+    seedSpin->setRange(0, 999999);
+    seedSpin->setValue(0);
+    gridLayout->addWidget(seedSpin, 5, 1, 1, 1);
+
+    QLabel *label_6 = new QLabel("Downsample :", this);
+    gridLayout->addWidget(label_6, 6, 0, 1, 1);
+
+    downsampleSpin = new QSpinBox(this);
+    downsampleSpin->setAlignment(Qt::AlignCenter);
+    downsampleSpin->setRange(1, 8);
+    downsampleSpin->setValue(1);
+    downsampleSpin->setSpecialValueText("Off");
+    gridLayout->addWidget(downsampleSpin, 6, 1, 1, 1);
 
     enhanceShadowsBtn = new QCheckBox("Enhance Shadows", this);
-    gridLayout->addWidget(enhanceShadowsBtn, 3, 0, 1, 1);
+    gridLayout->addWidget(enhanceShadowsBtn, 7, 0, 1, 1);
+
+    previewBtn = new QPushButton("Preview", this);
+    gridLayout->addWidget(previewBtn, 8, 0, 1, 1);
+
+    statusLabel = new QLabel(this);
+    gridLayout->addWidget(statusLabel, 8, 1, 1, 1);
+
+    previewLabel = new QLabel(this);
+    previewLabel->setAlignment(Qt::AlignCenter);
+    gridLayout->addWidget(previewLabel, 9, 0, 1, 2);
 
     QDialogButtonBox *buttonBox = new QDialogButtonBox(Qt::Horizontal, this);
     buttonBox->setStandardButtons(QDialogButtonBox::Cancel|QDialogButtonBox::Ok);
-    gridLayout->addWidget(buttonBox, 4, 0, 1, 2);
+    gridLayout->addWidget(buttonBox, 10, 0, 1, 2);
 
+    methodCombo->setToolTip(METHOD_DESC);
     radiusSpin->setToolTip(RADIUS_DESC);
     samplesSpin->setToolTip(SAMPLES_DESC);
     iterationsSpin->setToolTip(ITERATIONS_DESC);
+    toleranceSpin->setToolTip(TOLERANCE_DESC);
+    seedSpin->setToolTip(SEED_DESC);
+    downsampleSpin->setToolTip(DOWNSAMPLE_DESC);
     enhanceShadowsBtn->setToolTip(ENHANCE_SHADOWS_DESC);
+    previewBtn->setToolTip(PREVIEW_DESC);
+    label_0->setToolTip(METHOD_DESC);
     label->setToolTip(RADIUS_DESC);
     label_2->setToolTip(SAMPLES_DESC);
     label_3->setToolTip(ITERATIONS_DESC);
+    label_4->setToolTip(TOLERANCE_DESC);
+    label_5->setToolTip(SEED_DESC);
+    label_6->setToolTip(DOWNSAMPLE_DESC);
 
+    connect(methodCombo, SIGNAL(currentIndexChanged(int)), this, SLOT(setMethod(int)));
+    connect(previewBtn, SIGNAL(clicked()), this, SLOT(runPreview()));
     connect(buttonBox, SIGNAL(accepted()), this, SLOT(accept()));
     connect(buttonBox, SIGNAL(rejected()), this, SLOT(reject()));
 }
+
+// enable only the options used by the method
+void
+GrayScaleDialog:: setMethod(int method)
+{
+    bool sampling = (method==METHOD_SAMPLING);
+    bool local = (method!=METHOD_GLOBAL);
+    radiusSpin->setEnabled(local);
+    samplesSpin->setEnabled(sampling);
+    iterationsSpin->setEnabled(sampling);
+    toleranceSpin->setEnabled(sampling);
+    seedSpin->setEnabled(sampling or method==METHOD_GLOBAL);
+    downsampleSpin->setEnabled(sampling);
+    enhanceShadowsBtn->setEnabled(local);
+}
+
+// iterations to be used for the final result
+int
+GrayScaleDialog:: iterations()
+{
+    if (accepted_early)
+        return preview_iterations;
+    return iterationsSpin->value();
+}
+
+#define PREVIEW_W 320
+#define PREVIEW_H 240
+
+void
+GrayScaleDialog:: runPreview()
+{
+    if (preview_running) {// works as Stop button
+        stop_preview = true;
+        return;
+    }
+    QImage proxy = image;
+    if (image.width() > PREVIEW_W or image.height() > PREVIEW_H) {
+        proxy = image.scaled(PREVIEW_W, PREVIEW_H, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        proxy = proxy.convertToFormat(image.format());
+    }
+    int radius = qMax(1, radiusSpin->value() * proxy.width() / image.width());
+    int total = iterationsSpin->value();
+
+    if (methodCombo->currentIndex()==METHOD_GLOBAL) {
+        QImage result = color2gray_global(proxy, seedSpin->value(), NULL);
+        previewLabel->setPixmap(QPixmap::fromImage(result));
+        statusLabel->setText("");
+        return;
+    }
+    if (methodCombo->currentIndex()==METHOD_EXACT) {// no iterations to show
+        Color2GrayOptions options;
+        options.exact = true;
+        QImage result = color2gray(proxy, radius, 0, 0, enhanceShadowsBtn->isChecked(), options);
+        previewLabel->setPixmap(QPixmap::fromImage(result));
+        statusLabel->setText("");
+        return;
+    }
+
+    preview_running = true;
+    stop_preview = false;
+    previewBtn->setText("Stop");
+    color2gray_progressive(proxy, radius, samplesSpin->value(), total,
+                           enhanceShadowsBtn->isChecked(), seedSpin->value(),
+                           [&](QImage &result, int n) {
+        previewLabel->setPixmap(QPixmap::fromImage(result));
+        statusLabel->setText(QString("Iteration %1/%2").arg(n).arg(total));
+        preview_iterations = n;
+        QApplication::processEvents();
+        return not stop_preview;
+    });
+    preview_running = false;
+    previewBtn->setText("Preview");
+}
+
+void
+GrayScaleDialog:: accept()
+{
+    if (preview_running) {
+        accepted_early = true;
+        stop_preview = true;
+    }
+    QDialog::accept();
+}
+
+void
+GrayScaleDialog:: reject()
+{
+    stop_preview = true;
+    QDialog::reject();
+}
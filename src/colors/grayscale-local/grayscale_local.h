@@ -2,7 +2,11 @@
 #include "plugin.h"
 #include <QDialog>
 #include <QSpinBox>
+#include <QDoubleSpinBox>
 #include <QCheckBox>
+#include <QComboBox>
+#include <QLabel>
+#include <QPushButton>
 
 class FilterPlugin : public QObject, Plugin
 {
@@ -25,13 +29,37 @@ signals:
 };
 
 
+// conversion methods
+#define METHOD_SAMPLING 0
+#define METHOD_EXACT    1
+#define METHOD_GLOBAL   2
+
 class GrayScaleDialog : public QDialog
 {
+    Q_OBJECT
 public:
+    QComboBox *methodCombo;
     QSpinBox *radiusSpin;
     QSpinBox *samplesSpin;
     QSpinBox *iterationsSpin;
+    QDoubleSpinBox *toleranceSpin;
+    QSpinBox *seedSpin;
+    QSpinBox *downsampleSpin;
     QCheckBox *enhanceShadowsBtn;
+    QPushButton *previewBtn;
+    QLabel *statusLabel;
+    QLabel *previewLabel;
+    QImage &image;
+    bool preview_running = false;
+    bool stop_preview = false;
+    bool accepted_early = false;// accepted before preview finished all iterations
+    int preview_iterations = 0;
 
-    GrayScaleDialog(QWidget *parent);
+    GrayScaleDialog(QWidget *parent, QImage &image);
+    int iterations();
+public slots:
+    void setMethod(int method);
+    void runPreview();
+    void accept();
+    void reject();
 };
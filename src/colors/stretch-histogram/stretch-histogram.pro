@@ -7,9 +7,9 @@ INCLUDEPATH += $$DESTDIR
 
 TEMPLATE        = lib
 CONFIG         += plugin
-QMAKE_CXXFLAGS  = -std=c++11
+QMAKE_CXXFLAGS  = -std=c++11 -fopenmp
 QMAKE_LFLAGS   += -s
-LIBS           +=
+LIBS           += -lgomp
 
 QT += widgets
 
@@ -2,9 +2,16 @@
     Copyright (C) 2020-2024 Arindam Chaudhuri <ksharindam@gmail.com>
 */
 #include "stretch_histogram.h"
+#include "histogram.h"
+#include <QFileDialog>
+#include <vector>
 
 #define PLUGIN_NAME "Stretch Histogram"
 #define PLUGIN_MENU "Filters/Color/Histogram Equalize"
+#define PLUGIN_MENU_SEQUENCE "Filters/Color/Histogram Equalize (Sequence)"
+#define PLUGIN_MENU_SEQUENCE_NEW "Filters/Color/Histogram Equalize (New Sequence)"
+#define PLUGIN_MENU_MATCH "Filters/Color/Histogram Match"
+#define PLUGIN_MENU_MATCH_REF "Filters/Color/Histogram Match Reference..."
 #define PLUGIN_VERSION "1.0"
 
 #if QT_VERSION < QT_VERSION_CHECK(5, 0, 0)
@@ -30,55 +37,380 @@ void stretchHistogramChannel(uint histogram[])
     uint low  = cumu_hist[0];
     uint high = cumu_hist[255];
 
-    if (low != high) {
-        for (int i=0; i < 256; i++) {
+    for (int i=0; i < 256; i++) {
+        if (low != high)
             histogram[i] = 255 * (cumu_hist[i]-low)/(high-low);
-        }
+        else // all pixels have same value
+            histogram[i] = i;
     }
 }
 
-void stretchHistogram(QImage &img)
+// map each pixel through the levels of each channel
+static void
+applyLevels(QImage &img, uint levels_r[], uint levels_g[], uint levels_b[])
 {
     int w = img.width();
     int h = img.height();
-    // Create Histogram
-    uint histogram_r[256] = {};
-    uint histogram_g[256] = {};
-    uint histogram_b[256] = {};
 
+    #pragma omp parallel for
     for (int y=0; y<h; y++) {
-        QRgb *row = (QRgb*) img.constScanLine(y);
+        QRgb *row = (QRgb*) img.scanLine(y);
         for (int x=0; x<w; x++) {
-            ++histogram_r[qRed(row[x])];
-            ++histogram_g[qGreen(row[x])];
-            ++histogram_b[qBlue(row[x])];
+            int r = levels_r[qRed(row[x])];
+            int g = levels_g[qGreen(row[x])];
+            int b = levels_b[qBlue(row[x])];
+            row[x] = qRgba(r,g,b, qAlpha(row[x]));
         }
     }
+}
+
+void stretchHistogram(QImage &img)
+{
+    // Create Histogram
+    Histogram hist;
+    getImageHistogram(img, hist);
+    uint *histogram_r = hist.r;
+    uint *histogram_g = hist.g;
+    uint *histogram_b = hist.b;
     // Stretch Histogram of three channels
     stretchHistogramChannel(histogram_r);
     stretchHistogramChannel(histogram_g);
     stretchHistogramChannel(histogram_b);
     // Apply Levels
+    applyLevels(img, histogram_r, histogram_g, histogram_b);
+}
+
+//*********** ----------- Histogram Matching ----------- ************ //
+/* Maps the histogram of an image to the histogram of a reference image.
+   If T is the equalizing levels of the image, and G is the equalizing levels
+   of reference, then the matching levels are G^-1(T(v)).
+   G^-1 is computed once for a reference, then each image needs only one
+   pass for counting histogram, and one pass for applying levels.
+*/
+
+// invert equalizing levels, i.e for each level get smallest value that maps to it
+static void
+invertLevels(uint levels[], uint inverse[])
+{
+    for (int v=0, e=0; e < 256; e++) {
+        while (v < 255 && levels[v] < (uint)e)
+            v++;
+        inverse[e] = v;
+    }
+}
+
+void histogramMatchReference(QImage &ref, MatchReference &match_ref)
+{
+    Histogram hist;
+    getImageHistogram(ref, hist);
+    stretchHistogramChannel(hist.r);
+    stretchHistogramChannel(hist.g);
+    stretchHistogramChannel(hist.b);
+    invertLevels(hist.r, match_ref.r);
+    invertLevels(hist.g, match_ref.g);
+    invertLevels(hist.b, match_ref.b);
+}
+
+void histogramMatch(QImage &img, const MatchReference &match_ref)
+{
+    Histogram hist;
+    getImageHistogram(img, hist);
+    stretchHistogramChannel(hist.r);
+    stretchHistogramChannel(hist.g);
+    stretchHistogramChannel(hist.b);
+    for (int i=0; i<256; i++) {
+        hist.r[i] = match_ref.r[hist.r[i]];
+        hist.g[i] = match_ref.g[hist.g[i]];
+        hist.b[i] = match_ref.b[hist.b[i]];
+    }
+    applyLevels(img, hist.r, hist.g, hist.b);
+}
+
+// match a batch of images to same reference, reference levels are computed once
+void histogramMatch(QList<QImage> &images, QImage &ref)
+{
+    MatchReference match_ref;
+    histogramMatchReference(ref, match_ref);
+    for (int i=0; i<images.count(); i++) {
+        histogramMatch(images[i], match_ref);
+    }
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+//*********** --------- Stretch Histogram (16 bit) -------- ************ //
+/* Three 65536 bin histograms (768KB) do not fit in cache, so each thread
+   counts into its own partial histograms, and a band of rows is counted
+   one channel at a time. Thus only one 256KB histogram is being updated
+   at a time, while the band of rows stays in cache for next channel.
+*/
+#define BINS_16        65536
+#define BAND_PIXELS    8192 /* 64KB of RGBA64 pixels */
+#define SCAN_BLOCKS    64
+
+// Stretch Histogram of a 16 bit channel to 0-65535 range
+static void
+stretchHistogramChannel16(quint64 histogram[], quint16 levels[])
+{
+    // cumulative histogram, using parallel blocked prefix sum
+    quint64 block_sum[SCAN_BLOCKS];
+    int block_size = BINS_16/SCAN_BLOCKS;
+
+    #pragma omp parallel for
+    for (int blk=0; blk < SCAN_BLOCKS; blk++) {
+        quint64 count = 0;
+        for (int i=blk*block_size; i < (blk+1)*block_size; i++) {
+            count += histogram[i];
+            histogram[i] = count;
+        }
+        block_sum[blk] = count;
+    }
+    quint64 offset[SCAN_BLOCKS];
+    for (quint64 count=0, blk=0; blk < SCAN_BLOCKS; blk++) {
+        offset[blk] = count;
+        count += block_sum[blk];
+    }
+    #pragma omp parallel for
+    for (int blk=1; blk < SCAN_BLOCKS; blk++) {
+        for (int i=blk*block_size; i < (blk+1)*block_size; i++)
+            histogram[i] += offset[blk];
+    }
+    // Stretch the histogram based on cumulative histogram
+    quint64 low  = histogram[0];
+    quint64 high = histogram[BINS_16-1];
+
+    for (int i=0; i < BINS_16; i++) {
+        if (low != high)
+            levels[i] = 65535 * (histogram[i]-low)/(high-low);
+        else
+            levels[i] = i;
+    }
+}
+
+void stretchHistogram16(QImage &img)
+{
+    int w = img.width();
+    int h = img.height();
+    // Create Histogram
+    std::vector<quint64> histogram(3*BINS_16);
+    int band_h = BAND_PIXELS/w + 1;
+    int band_count = (h+band_h-1)/band_h;
+
+    #pragma omp parallel
+    {
+        std::vector<uint> hist(3*BINS_16);// partial histograms of this thread
+
+        #pragma omp for
+        for (int band=0; band < band_count; band++)
+        {
+            int y_end = std::min((band+1)*band_h, h);
+            for (int c=0; c<3; c++) {
+                uint *hist_c = hist.data() + c*BINS_16;
+                for (int y=band*band_h; y<y_end; y++) {
+                    const quint16 *row = (const quint16*) img.constScanLine(y);
+                    for (int x=0; x<w; x++) {
+                        ++hist_c[row[4*x+c]];
+                    }
+                }
+            }
+        }
+        #pragma omp critical
+        {
+            for (int i=0; i<3*BINS_16; i++)
+                histogram[i] += hist[i];
+        }
+    }
+    // Stretch Histogram of three channels
+    std::vector<quint16> levels(3*BINS_16);
+    for (int c=0; c<3; c++)
+        stretchHistogramChannel16(histogram.data() + c*BINS_16, levels.data() + c*BINS_16);
+    // Apply Levels
+    const quint16 *levels_r = levels.data();
+    const quint16 *levels_g = levels_r + BINS_16;
+    const quint16 *levels_b = levels_g + BINS_16;
+
+    #pragma omp parallel for
+    for (int y=0; y<h; y++) {
+        quint16 *row = (quint16*) img.scanLine(y);
+        for (int x=0; x<4*w; x+=4) {
+            quint16 r = levels_r[row[x]];
+            quint16 g = levels_g[row[x+1]];
+            quint16 b = levels_b[row[x+2]];
+            row[x]   = r;
+            row[x+1] = g;
+            row[x+2] = b;
+        }
+    }
+}
+#endif
+
+//*********** ------- Stretch Histogram (Sequence) ------- ************ //
+/* For timelapse or video frames, equalizing each frame independently needs
+   two passes per frame and the levels flicker from frame to frame.
+   In sequence mode the levels are taken from a running histogram of the
+   previous frames, so the current frame's histogram can be counted in the
+   same pass in which the levels are applied. After each frame the running
+   histogram is updated as  running = smoothing*running + (1-smoothing)*current
+*/
+
+// Weight of previous frames in running histogram (0 to 1)
+#define SEQUENCE_SMOOTHING 0.75f
+
+static void
+resetSequenceHistogram(SequenceHistogram &state, QImage &img)
+{
+    Histogram hist;
+    getImageHistogram(img, hist);
+
+    for (int i=0; i<256; i++) {
+        state.r[i] = hist.r[i];
+        state.g[i] = hist.g[i];
+        state.b[i] = hist.b[i];
+    }
+    state.width = img.width();
+    state.height = img.height();
+    state.valid = true;
+}
+
+void stretchHistogramSequence(QImage &img, SequenceHistogram &state, float smoothing)
+{
+    int w = img.width();
+    int h = img.height();
+    // first frame, or a frame which does not belong to this sequence
+    if (not state.valid or state.width!=w or state.height!=h)
+        resetSequenceHistogram(state, img);
+
+    // Levels from running histogram
+    uint levels_r[256], levels_g[256], levels_b[256];
+    for (int i=0; i<256; i++) {
+        levels_r[i] = state.r[i] + 0.5f;
+        levels_g[i] = state.g[i] + 0.5f;
+        levels_b[i] = state.b[i] + 0.5f;
+    }
+    stretchHistogramChannel(levels_r);
+    stretchHistogramChannel(levels_g);
+    stretchHistogramChannel(levels_b);
+    // Apply Levels and count histogram of this frame in same pass
+    uint histogram_r[256] = {};
+    uint histogram_g[256] = {};
+    uint histogram_b[256] = {};
+
     for (int y=0; y<h; y++) {
         QRgb *row = (QRgb*) img.scanLine(y);
         for (int x=0; x<w; x++) {
-            int r = histogram_r[qRed(row[x])];
-            int g = histogram_g[qGreen(row[x])];
-            int b = histogram_b[qBlue(row[x])];
-            row[x] = qRgba(r,g,b, qAlpha(row[x]));
+            QRgb clr = row[x];
+            ++histogram_r[qRed(clr)];
+            ++histogram_g[qGreen(clr)];
+            ++histogram_b[qBlue(clr)];
+            row[x] = qRgba(levels_r[qRed(clr)], levels_g[qGreen(clr)],
+                            levels_b[qBlue(clr)], qAlpha(clr));
         }
     }
+    // Update running histogram
+    for (int i=0; i<256; i++) {
+        state.r[i] = smoothing*state.r[i] + (1.0f-smoothing)*histogram_r[i];
+        state.g[i] = smoothing*state.g[i] + (1.0f-smoothing)*histogram_g[i];
+        state.b[i] = smoothing*state.b[i] + (1.0f-smoothing)*histogram_b[i];
+    }
 }
 
 // ************** ----------  Plugin Class -----------************* //
 
-QString FilterPlugin:: menuItem()
+QStringList FilterPlugin:: menuItems()
 {
-    return QString(PLUGIN_MENU);
+    return QStringList({PLUGIN_MENU, PLUGIN_MENU_SEQUENCE, PLUGIN_MENU_SEQUENCE_NEW,
+                        PLUGIN_MENU_MATCH, PLUGIN_MENU_MATCH_REF});
+}
+
+void FilterPlugin:: handleAction(QAction *action, int /*type*/)
+{
+    if (action->text() == QString(PLUGIN_MENU_SEQUENCE).section('/', -1))
+        connect(action, SIGNAL(triggered()), this, SLOT(equalizeSequence()));
+    else if (action->text() == QString(PLUGIN_MENU_SEQUENCE_NEW).section('/', -1))
+        connect(action, SIGNAL(triggered()), this, SLOT(startNewSequence()));
+    else if (action->text() == QString(PLUGIN_MENU_MATCH).section('/', -1))
+        connect(action, SIGNAL(triggered()), this, SLOT(matchHistogram()));
+    else if (action->text() == QString(PLUGIN_MENU_MATCH_REF).section('/', -1))
+        connect(action, SIGNAL(triggered()), this, SLOT(selectMatchReference()));
+    else
+        connect(action, SIGNAL(triggered()), this, SLOT(onMenuClick()));
+}
+
+// the 8 bit levels can not be applied on images with more bits per channel
+bool FilterPlugin:: checkImageDepth()
+{
+    if (data->image.depth() <= 32)
+        return true;
+    emit sendNotification(PLUGIN_NAME, "Only 8 bit per channel images are supported");
+    return false;
 }
 
 void FilterPlugin:: onMenuClick()
 {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    if (data->image.format()==QImage::Format_RGBA64_Premultiplied) {
+        // levels are applied on unpremultiplied colors
+        QImage img = data->image.convertToFormat(QImage::Format_RGBA64);
+        stretchHistogram16(img);
+        data->image = img.convertToFormat(QImage::Format_RGBA64_Premultiplied);
+        emit imageChanged();
+        return;
+    }
+    if (data->image.format()==QImage::Format_RGBA64 ||
+        data->image.format()==QImage::Format_RGBX64) {
+        stretchHistogram16(data->image);
+        emit imageChanged();
+        return;
+    }
+#endif
+    if (not checkImageDepth())
+        return;
     stretchHistogram(data->image);
     emit imageChanged();
 }
+
+// open the frames one by one and apply this on each
+void FilterPlugin:: equalizeSequence()
+{
+    if (not checkImageDepth())
+        return;
+    stretchHistogramSequence(data->image, sequence_hist, SEQUENCE_SMOOTHING);
+    emit imageChanged();
+}
+
+// first frame of another sequence, levels of previous frames are discarded,
+// even if the frames are of same size
+void FilterPlugin:: startNewSequence()
+{
+    sequence_hist.valid = false;
+    equalizeSequence();
+}
+
+// the reference is kept, so that all photos of a shoot can be matched to it
+void FilterPlugin:: matchHistogram()
+{
+    if (not checkImageDepth())
+        return;
+    if (match_ref_file.isEmpty())
+        selectMatchReference();
+    if (match_ref_file.isEmpty())
+        return;
+    histogramMatch(data->image, match_ref);
+    emit imageChanged();
+}
+
+void FilterPlugin:: selectMatchReference()
+{
+    QString filefilter = "Image files (*.jpg *.png *.jpeg *.tif *.tiff *.bmp);;All Files (*)";
+    QString filepath = QFileDialog::getOpenFileName(data->window, "Open Reference Image",
+                                                    match_ref_file, filefilter);
+    if (filepath.isEmpty())
+        return;
+    QImage ref(filepath);
+    if (ref.isNull()) {
+        emit sendNotification("Error", "Could not open reference image");
+        return;
+    }
+    ref = ref.convertToFormat(QImage::Format_ARGB32);
+    histogramMatchReference(ref, match_ref);
+    match_ref_file = filepath;
+}
@@ -1,5 +1,28 @@
 #pragma once
 #include "plugin.h"
+#include <QList>
+
+// running histogram of previous frames, used by sequence mode
+typedef struct {
+    float r[256];
+    float g[256];
+    float b[256];
+    int width;
+    int height;
+    bool valid;
+} SequenceHistogram;
+
+// inverse of equalizing levels of reference image, used by histogram matching
+typedef struct {
+    uint r[256];
+    uint g[256];
+    uint b[256];
+} MatchReference;
+
+void histogramMatchReference(QImage &ref, MatchReference &match_ref);
+void histogramMatch(QImage &img, const MatchReference &match_ref);
+// match a batch of images to same reference
+void histogramMatch(QList<QImage> &images, QImage &ref);
 
 class FilterPlugin : public QObject, Plugin
 {
@@ -10,10 +33,20 @@ class FilterPlugin : public QObject, Plugin
 #endif
 
 public:
-    QString menuItem();
+    SequenceHistogram sequence_hist = {};
+    MatchReference match_ref;
+    QString match_ref_file;
+
+    QStringList menuItems();
+    void handleAction(QAction *action, int type);
+    bool checkImageDepth();
 
 public slots:
     void onMenuClick();
+    void equalizeSequence();
+    void startNewSequence();
+    void matchHistogram();
+    void selectMatchReference();
 
 signals:
     void imageChanged();
@@ -3,6 +3,7 @@
 */
 #include "kuwahara.h"
 #include <cmath>
+#include <algorithm>
 #include <QInputDialog>
 
 #define PLUGIN_NAME "Kuwahara Filter"
@@ -45,6 +46,12 @@ inline double getPixelLuma(double red, double green, double blue)
   return (0.212656*red + 0.715158*green + 0.072186*blue);
 }
 
+// Luminance in fixed point scaled by 256, weights are same as above in 15 bit
+inline uint getPixelLumaFixed(QRgb clr)
+{
+  return (6968*qRed(clr) + 23434*qGreen(clr) + 2366*qBlue(clr)) >> 7;
+}
+
 
 typedef struct {
     int x;
@@ -188,9 +195,108 @@ void convolve1D(QImage &img, float kernel[], int width/*of kernel*/)
 
 #define PI 3.141593f
 
+/* Recursive gaussian filter of Young and van Vliet, "Recursive implementation
+   of the Gaussian filter" (1995). A causal and an anticausal 3rd order filter
+   are run along each row and then along each column, so the cost per pixel does
+   not depend on sigma, while convolve1D() costs 2*radius+1 per pixel.
+   It approximates a gaussian which is not truncated at radius. It is less
+   accurate for small sigma, so used only when radius is large.
+*/
+#define RECURSIVE_GAUSS_MIN_RADIUS 6
+
+#define Clamp(a) ( (a)&(~0xff) ? (uchar)((~a)>>31) : (a) )
+
+// filter len pixels of R, G, B stored one after another, in both directions
+static void recursiveGaussLine(float *line, int len, float B, float b1, float b2, float b3)
+{
+    // start in steady state of first and last pixel, as if border is repeated
+    float w1[3], w2[3], w3[3];
+    for (int c=0; c<3; c++)
+        w1[c] = w2[c] = w3[c] = line[c];
+    for (int i=0; i<len; i++) {
+        for (int c=0; c<3; c++) {// 3 independent channels at once
+            float w0 = B*line[3*i+c] + b1*w1[c] + b2*w2[c] + b3*w3[c];
+            line[3*i+c] = w0;
+            w3[c] = w2[c]; w2[c] = w1[c]; w1[c] = w0;
+        }
+    }
+    for (int c=0; c<3; c++)
+        w1[c] = w2[c] = w3[c] = line[3*(len-1)+c];
+    for (int i=len-1; i>=0; i--) {
+        for (int c=0; c<3; c++) {
+            float w0 = B*line[3*i+c] + b1*w1[c] + b2*w2[c] + b3*w3[c];
+            line[3*i+c] = w0;
+            w3[c] = w2[c]; w2[c] = w1[c]; w1[c] = w0;
+        }
+    }
+}
+
+void recursiveGaussianBlur(QImage &img, float sigma)
+{
+    // coefficients for sigma >= 0.5
+    double q = sigma >= 2.5 ? 0.98711*sigma - 0.96330 : 3.97156 - 4.14554*sqrt(1 - 0.26891*sigma);
+    double b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+    float b1 = (2.44413*q + 2.85619*q*q + 1.26661*q*q*q) / b0;
+    float b2 = -(1.4281*q*q + 1.26661*q*q*q) / b0;
+    float b3 = (0.422205*q*q*q) / b0;
+    float B = 1 - (b1 + b2 + b3);
+
+    int w = img.width();
+    int h = img.height();
+    // response decays slowly, so border pixels are repeated for 3*sigma pixels
+    // before the filter reaches the image
+    int pad = ceilf(3*sigma);
+    QRgb *data = (QRgb*)img.scanLine(0);
+
+    #pragma omp parallel
+    {
+        float *line = (float*) malloc((std::max(w,h) + 2*pad)*3*sizeof(float));
+
+        #pragma omp for
+        for (int y=0; y<h; y++)
+        {
+            QRgb *row = data + y*w;
+            for (int i=0; i < w+2*pad; i++) {
+                QRgb clr = row[std::min(std::max(i-pad, 0), w-1)];
+                line[3*i] = qRed(clr);
+                line[3*i+1] = qGreen(clr);
+                line[3*i+2] = qBlue(clr);
+            }
+            recursiveGaussLine(line, w+2*pad, B, b1, b2, b3);
+            for (int x=0; x<w; x++) {
+                float *val = line + 3*(x+pad);
+                int r = lroundf(val[0]), g = lroundf(val[1]), b = lroundf(val[2]);
+                row[x] = qRgba(Clamp(r), Clamp(g), Clamp(b), qAlpha(row[x]));
+            }
+        }
+        #pragma omp for
+        for (int x=0; x<w; x++)
+        {
+            QRgb *col = data + x;
+            for (int i=0; i < h+2*pad; i++) {
+                QRgb clr = col[std::min(std::max(i-pad, 0), h-1)*w];
+                line[3*i] = qRed(clr);
+                line[3*i+1] = qGreen(clr);
+                line[3*i+2] = qBlue(clr);
+            }
+            recursiveGaussLine(line, h+2*pad, B, b1, b2, b3);
+            for (int y=0; y<h; y++) {
+                float *val = line + 3*(y+pad);
+                int r = lroundf(val[0]), g = lroundf(val[1]), b = lroundf(val[2]);
+                col[y*w] = qRgba(Clamp(r), Clamp(g), Clamp(b), qAlpha(col[y*w]));
+            }
+        }
+        free(line);
+    }
+}
+
 void gaussianBlur(QImage &img, int radius, float sigma/*standard deviation*/)
 {
     if (sigma==0)  sigma = radius/2.0 ;
+    if (radius >= RECURSIVE_GAUSS_MIN_RADIUS) {
+        recursiveGaussianBlur(img, sigma);
+        return;
+    }
     int kernel_width = 2*radius + 1;
     // build 1D gaussian kernel
     float kernel[kernel_width];
@@ -204,6 +310,72 @@ void gaussianBlur(QImage &img, int radius, float sigma/*standard deviation*/)
     convolve1D(img, kernel, kernel_width);
 }
 
+/* Summed area tables of luminance and squared luminance, with an extra first
+   row and column of zeros. Sum of a rectangle is then obtained from its four
+   corners, in constant time for any size. Sums are unsigned and may wrap around,
+   but the sum of a rectangle is still exact if it fits in the type. With
+   fixed point luminance upto 65280, sum of a quadrant fits in 32 bit for radius
+   upto 255, and sum of squares multiplied by pixel count in 64 bit.
+*/
+#define KUWAHARA_MAX_RADIUS 255
+
+typedef struct {
+    int w;// width of table, one more than image width
+    uint *sum;
+    quint64 *sum_sq;
+} LumaTable;
+
+void buildLumaTable(QImage &img, LumaTable &table)
+{
+    int w = img.width();
+    int h = img.height();
+    table.w = w+1;
+    table.sum = (uint*) calloc((w+1)*(h+1), sizeof(uint));
+    table.sum_sq = (quint64*) calloc((w+1)*(h+1), sizeof(quint64));
+    // sums along each row
+    #pragma omp parallel for
+    for (int y=0; y<h; y++)
+    {
+        QRgb *row = (QRgb*)img.constScanLine(y);
+        uint *sum = table.sum + (y+1)*table.w;
+        quint64 *sum_sq = table.sum_sq + (y+1)*table.w;
+        for (int x=0; x<w; x++) {
+            uint luma = getPixelLumaFixed(row[x]);
+            sum[x+1] = sum[x] + luma;
+            sum_sq[x+1] = sum_sq[x] + (quint64)luma*luma;
+        }
+    }
+    // add the row above to each row
+    for (int y=1; y<h; y++)
+    {
+        uint *sum = table.sum + (y+1)*table.w;
+        quint64 *sum_sq = table.sum_sq + (y+1)*table.w;
+        for (int x=1; x<=w; x++) {
+            sum[x] += sum[x-table.w];
+            sum_sq[x] += sum_sq[x-table.w];
+        }
+    }
+}
+
+// sum of squared deviations of luminance from mean, in a rectangle
+inline double getLumaVariance(LumaTable &table, RectInfo &rect)
+{
+    int top_left = rect.y*table.w + rect.x;
+    int top_right = top_left + rect.width;
+    int bottom_left = top_left + rect.height*table.w;
+    int bottom_right = bottom_left + rect.width;
+    uint sum = table.sum[bottom_right] - table.sum[bottom_left]
+             - table.sum[top_right] + table.sum[top_left];
+    quint64 sum_sq = table.sum_sq[bottom_right] - table.sum_sq[bottom_left]
+                   - table.sum_sq[top_right] + table.sum_sq[top_left];
+    // as luminance is a linear combination of R, G, B, luminance of mean color
+    // is same as mean luminance, so variance = sum(luma^2) - sum(luma)^2/n.
+    // n*sum(luma^2) - sum(luma)^2 is exact in 64 bit, so equal variances
+    // remain equal, as in direct calculation
+    quint64 n = rect.width*rect.height;
+    return (n*sum_sq - (quint64)sum*sum) / (n*256.0*256.0);
+}
+
 void kuwaharaFilter(QImage &img, int radius)
 {
     int w = img.width();
@@ -212,6 +384,9 @@ void kuwaharaFilter(QImage &img, int radius)
     gaussianBlur(gaussImg, radius, 0);
     int width = radius+1;
 
+    LumaTable table;
+    buildLumaTable(gaussImg, table);
+
     QRgb *srcData = (QRgb*)gaussImg.constScanLine(0);
     QRgb *dstData = (QRgb*)img.scanLine(0);
     #pragma omp parallel for
@@ -263,34 +438,8 @@ void kuwaharaFilter(QImage &img, int radius)
                 }
                 else if (quadrant.y+quadrant.height>h)
                     quadrant.height = h-quadrant.y;
-                // calculate mean of variance
-                double mean_r = 0, mean_g = 0, mean_b = 0;
-                QRgb *quadRow = srcData + (w*quadrant.y + quadrant.x);
-                // for each pixel in quadrant
-                for (int m=0; m<quadrant.height; m++)
-                {
-                    for (int n=0; n<quadrant.width; n++) {
-                      mean_r += (double) qRed(quadRow[n]);
-                      mean_g += (double) qGreen(quadRow[n]);
-                      mean_b += (double) qBlue(quadRow[n]);
-                    }
-                    quadRow += w;
-                }
-                mean_r /= (quadrant.width*quadrant.height);
-                mean_g /= (quadrant.width*quadrant.height);
-                mean_b /= (quadrant.width*quadrant.height);
-
-                double mean_luma = getPixelLuma(mean_r, mean_g, mean_b);
-                double variance=0.0;
-                quadRow = srcData + (w*quadrant.y + quadrant.x);
-                for (int m=0; m<quadrant.height; m++)
-                {
-                    for (int n=0; n<quadrant.width; n++) {
-                      double luma = getPixelLuma(quadRow[n]);
-                      variance += (luma-mean_luma)*(luma-mean_luma);
-                    }
-                    quadRow += w;
-                }
+
+                double variance = getLumaVariance(table, quadrant);
                 if (variance < min_variance)
                 {
                     min_variance=variance;
@@ -301,6 +450,8 @@ void kuwaharaFilter(QImage &img, int radius)
             (dstData + w*y)[x] = clr;
         }   // end column loop
     } // end row loop
+    free(table.sum);
+    free(table.sum_sq);
 }
 
 
@@ -314,7 +465,7 @@ void FilterPlugin:: onMenuClick()
 {
     bool ok;
     int radius = QInputDialog::getInt(data->window, "Blur Radius", "Enter Blur Radius :",
-                                        3/*val*/, 1/*min*/, 50/*max*/, 1/*step*/, &ok);
+                                        3/*val*/, 1/*min*/, KUWAHARA_MAX_RADIUS/*max*/, 1/*step*/, &ok);
     if (not ok) return;
     kuwaharaFilter(data->image, radius);
     emit imageChanged();
@@ -0,0 +1,193 @@
+#pragma once
+/* This file is part of photoquick project, which is GPLv3 licensed */
+/* Histogram computation shared by the plugins.
+   Histograms are cached by QImage::cacheKey(), so when the same unchanged
+   image is viewed or equalized again, it does not need to be scanned.
+   Each plugin is a separate library, so the cache is attached to the
+   application object, and is shared by all plugins using this header.
+   Must be used from GUI thread only.
+*/
+#include <QImage>
+#include <QCoreApplication>
+#include <QVariant>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+    uint r[256];
+    uint g[256];
+    uint b[256];
+    uint y[256];// Luminance
+} Histogram;
+
+/* Luminance weights 0.2126, 0.7152, 0.0722 in 15 bit fixed point, they sum
+   to 32768 so that white gives 255. Fits in 16 bit for SSE2 multiply-add */
+#define LUMA_R_FIX  6966
+#define LUMA_G_FIX 23436
+#define LUMA_B_FIX  2366
+
+inline int fixedLuma(int r, int g, int b)
+{
+    return (r*LUMA_R_FIX + g*LUMA_G_FIX + b*LUMA_B_FIX) >> 15;
+}
+
+// count histograms of a row, luminance of 4 pixels is calculated at once using SSE2
+inline void countHistogramRow(const QRgb *row, int w, Histogram &hist)
+{
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    // pixels are stored as B,G,R,A bytes
+    const __m128i weights = _mm_setr_epi16(LUMA_B_FIX, LUMA_G_FIX, LUMA_R_FIX, 0,
+                                           LUMA_B_FIX, LUMA_G_FIX, LUMA_R_FIX, 0);
+    int luma[4];
+    for (; x+4 <= w; x+=4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(row+x));
+        // unpack to 16 bit, and get (B*wb + G*wg, R*wr) pairs of 4 pixels
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights);
+        __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2,0,2,0));
+        __m128 odd  = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3,1,3,1));
+        __m128i Y = _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd)), 15);
+        _mm_storeu_si128((__m128i*)luma, Y);
+        for (int i=0; i<4; i++) {
+            QRgb clr = row[x+i];
+            ++hist.r[qRed(clr)];
+            ++hist.g[qGreen(clr)];
+            ++hist.b[qBlue(clr)];
+            ++hist.y[luma[i]];
+        }
+    }
+#endif
+    for (; x<w; x++) {
+        int r = qRed(row[x]);
+        int g = qGreen(row[x]);
+        int b = qBlue(row[x]);
+        ++hist.r[r];
+        ++hist.g[g];
+        ++hist.b[b];
+        ++hist.y[fixedLuma(r,g,b)];
+    }
+}
+
+// rows of images in these formats can be read as QRgb
+inline bool isRgb32Format(const QImage &img)
+{
+    return (img.format()==QImage::Format_RGB32 || img.format()==QImage::Format_ARGB32 ||
+            img.format()==QImage::Format_ARGB32_Premultiplied);
+}
+
+// rows converted at once, for images in other formats (e.g 16 bit)
+#define HISTOGRAM_BAND_ROWS 64
+
+/* compute R, G, B and Luminance(Y) histograms of a region in one pass.
+   images in other than 32 bit formats are converted a band of rows at a time,
+   without keeping a converted copy of whole image */
+inline void computeHistogram(const QImage &img, QRect rect, Histogram &hist)
+{
+    rect = rect.intersected(img.rect());
+    int left = rect.x();
+    int w = rect.width();
+    int h = rect.height();
+    bool rgb32 = isRgb32Format(img);
+    int band_rows = rgb32 ? 1 : HISTOGRAM_BAND_ROWS;
+    int bands = (h + band_rows-1)/band_rows;
+    memset(&hist, 0, sizeof(Histogram));
+
+    #pragma omp parallel
+    {
+        Histogram local_hist = {};// each thread counts in its own bins
+
+        #pragma omp for schedule(static)
+        for (int i=0; i<bands; i++) {
+            int y = rect.y() + i*band_rows;
+            if (rgb32) {
+                const QRgb *row = (const QRgb*) img.constScanLine(y);
+                countHistogramRow(row + left, w, local_hist);
+                continue;
+            }
+            QImage band = img.copy(left, y, w, qMin(band_rows, rect.y()+h-y));
+            band = band.convertToFormat(QImage::Format_ARGB32);
+            for (int j=0; j<band.height(); j++)
+                countHistogramRow((const QRgb*) band.constScanLine(j), w, local_hist);
+        }
+        #pragma omp critical
+        {
+            for (int i=0; i<256; i++) {
+                hist.r[i] += local_hist.r[i];
+                hist.g[i] += local_hist.g[i];
+                hist.b[i] += local_hist.b[i];
+                hist.y[i] += local_hist.y[i];
+            }
+        }
+    }
+}
+
+inline void computeHistogram(const QImage &img, Histogram &hist)
+{
+    computeHistogram(img, img.rect(), hist);
+}
+
+#define HISTOGRAM_CACHE_SIZE 4
+/* Plugins built from different versions of this header share the cache, so the
+   version of the layout is in the name. Change it whenever the struct changes */
+#define HISTOGRAM_CACHE_PROPERTY "photoquick_histogram_cache_v2"
+
+typedef struct {
+    qint64 key[HISTOGRAM_CACHE_SIZE];
+    Histogram hist[HISTOGRAM_CACHE_SIZE];
+    int next;// entry to be replaced next
+} HistogramCache;
+
+// cache allocated by this plugin, if it was the first one to use the cache
+inline HistogramCache*& ownedHistogramCache()
+{
+    static HistogramCache *cache = NULL;
+    return cache;
+}
+
+// called while the application object is destroyed, before plugins are unloaded
+inline void freeHistogramCache()
+{
+    delete ownedHistogramCache();
+    ownedHistogramCache() = NULL;
+}
+
+// returns the cache shared by all plugins, it lives until the application exits
+inline HistogramCache* histogramCache()
+{
+    static HistogramCache local_cache = {};
+    QCoreApplication *app = QCoreApplication::instance();
+    if (not app)
+        return &local_cache;
+    QVariant var = app->property(HISTOGRAM_CACHE_PROPERTY);
+    if (var.isValid())
+        return (HistogramCache*) var.value<void*>();
+    HistogramCache *cache = new HistogramCache();
+    app->setProperty(HISTOGRAM_CACHE_PROPERTY, QVariant::fromValue((void*)cache));
+    ownedHistogramCache() = cache;
+    qAddPostRoutine(freeHistogramCache);
+    return cache;
+}
+
+// get histograms of image, from cache if the image has not changed since last time
+inline void getImageHistogram(const QImage &img, Histogram &hist)
+{
+    if (img.isNull()) {
+        memset(&hist, 0, sizeof(Histogram));
+        return;
+    }
+    HistogramCache *cache = histogramCache();
+    qint64 key = img.cacheKey();
+    for (int i=0; i<HISTOGRAM_CACHE_SIZE; i++) {
+        if (cache->key[i]==key) {
+            hist = cache->hist[i];
+            return;
+        }
+    }
+    computeHistogram(img, hist);
+    cache->key[cache->next] = key;
+    cache->hist[cache->next] = hist;
+    cache->next = (cache->next+1) % HISTOGRAM_CACHE_SIZE;
+}
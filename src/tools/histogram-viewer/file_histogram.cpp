@@ -0,0 +1,356 @@
+/*  This file is a part of PhotoQuick Plugins project, and is GNU GPLv3 licensed
+    Copyright (C) 2020-2024 Arindam Chaudhuri <ksharindam@gmail.com>
+*/
+/* Histogram of an image file, without loading whole image in memory.
+   Binary PPM/PGM and uncompressed 8 bit TIFF files are read in strips of
+   rows, each thread reads its own strips. For other formats, if the image
+   reader supports clip rect, the image is decoded in bands of rows, otherwise
+   whole image is decoded, and converted to 32 bit a band at a time.
+*/
+#include "histogram_viewer.h"
+#include <QFile>
+#include <QImageReader>
+#include <QImageIOHandler>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+
+#define STRIP_ROWS 64
+#define BAND_MEMORY (64*1024*1024)
+
+typedef struct {
+    int channels;// 1 for PGM, 3 for PPM
+    int width;
+    int height;
+    qint64 data_offset;
+} PnmInfo;
+
+// read next integer of PNM header, skipping whitespace and comments
+static bool
+readPnmInt(QFile &file, int &val)
+{
+    char c;
+    do {
+        if (not file.getChar(&c))
+            return false;
+        if (c=='#') {// skip comment line
+            while (c!='\n' && file.getChar(&c)) {}
+        }
+    } while (isspace(c));
+    val = 0;
+    while (isdigit(c)) {
+        val = val*10 + (c-'0');
+        if (not file.getChar(&c))
+            return false;
+    }
+    // single whitespace after last header value is consumed here
+    return true;
+}
+
+static bool
+readPnmHeader(QFile &file, PnmInfo &info)
+{
+    char magic[2];
+    if (file.read(magic, 2)!=2 || magic[0]!='P' || (magic[1]!='5' && magic[1]!='6'))
+        return false;
+    info.channels = magic[1]=='6' ? 3 : 1;
+    int maxval;
+    if (not readPnmInt(file, info.width) || not readPnmInt(file, info.height)
+            || not readPnmInt(file, maxval))
+        return false;
+    info.data_offset = file.pos();
+    // only 8 bit files are streamed
+    return maxval==255 && info.width>0 && info.height>0;
+}
+
+// a run of rows stored one after another in the file
+typedef struct {
+    qint64 offset;
+    int rows;
+} RowStrip;
+
+// count pixels of 8 bit samples, first sample is gray if there are 1 or 2
+// samples per pixel, otherwise first three are R, G, B
+static void
+countPixels(const uchar *buf, qint64 len, int channels, Histogram &hist)
+{
+    if (channels < 3) {
+        for (qint64 i=0; i<len; i+=channels) {
+            int v = buf[i];
+            ++hist.r[v];
+            ++hist.g[v];
+            ++hist.b[v];
+            ++hist.y[v];
+        }
+        return;
+    }
+    for (qint64 i=0; i<len; i+=channels) {
+        int r = buf[i];
+        int g = buf[i+1];
+        int b = buf[i+2];
+        ++hist.r[r];
+        ++hist.g[g];
+        ++hist.b[b];
+        ++hist.y[fixedLuma(r,g,b)];
+    }
+}
+
+// histogram of uncompressed pixels stored in strips, each at most STRIP_ROWS rows
+static bool
+getStripsHistogram(QString filename, std::vector<RowStrip> &strips, int width,
+                   int channels, Histogram &hist)
+{
+    int row_bytes = width*channels;
+    int strip_count = strips.size();
+    bool ok = true;
+    memset(&hist, 0, sizeof(Histogram));
+
+    #pragma omp parallel
+    {
+        QFile file(filename);
+        bool opened = file.open(QIODevice::ReadOnly);
+        std::vector<uchar> buf(size_t(row_bytes)*STRIP_ROWS);
+        Histogram local_hist = {};
+        bool local_ok = opened;
+
+        #pragma omp for schedule(dynamic)
+        for (int i=0; i<strip_count; i++)
+        {
+            qint64 len = qint64(strips[i].rows)*row_bytes;
+            if (not local_ok || not file.seek(strips[i].offset)
+                    || file.read((char*)buf.data(), len)!=len) {
+                local_ok = false;
+                continue;
+            }
+            countPixels(buf.data(), len, channels, local_hist);
+        }
+        #pragma omp critical
+        {
+            ok = ok && local_ok;
+            for (int i=0; i<256; i++) {
+                hist.r[i] += local_hist.r[i];
+                hist.g[i] += local_hist.g[i];
+                hist.b[i] += local_hist.b[i];
+                hist.y[i] += local_hist.y[i];
+            }
+        }
+    }
+    return ok;
+}
+
+// split rows stored contiguously from offset into strips of STRIP_ROWS
+static void
+addStrips(std::vector<RowStrip> &strips, qint64 offset, int rows, int row_bytes)
+{
+    for (int y=0; y<rows; y+=STRIP_ROWS) {
+        RowStrip strip = {offset + qint64(y)*row_bytes, std::min(STRIP_ROWS, rows-y)};
+        strips.push_back(strip);
+    }
+}
+
+static bool
+getPnmHistogram(QString filename, PnmInfo &info, Histogram &hist)
+{
+    std::vector<RowStrip> strips;
+    addStrips(strips, info.data_offset, info.height, info.width*info.channels);
+    return getStripsHistogram(filename, strips, info.width, info.channels, hist);
+}
+
+// ******** Uncompressed TIFF *********
+/* Only the first image of baseline TIFF is read, which must be uncompressed,
+   stored in strips (not tiles), with 8 bit gray or RGB samples interleaved.
+   Samples after R, G, B or gray (e.g alpha) are skipped.
+*/
+typedef struct {
+    int width;
+    int height;
+    int channels;// samples per pixel
+    std::vector<RowStrip> strips;
+} TiffInfo;
+
+#define TIFF_WIDTH          256
+#define TIFF_HEIGHT         257
+#define TIFF_BITS           258
+#define TIFF_COMPRESSION    259
+#define TIFF_PHOTOMETRIC    262
+#define TIFF_STRIP_OFFSETS  273
+#define TIFF_SAMPLES        277
+#define TIFF_ROWS_PER_STRIP 278
+#define TIFF_STRIP_BYTES    279
+#define TIFF_PLANAR         284
+#define TIFF_TILE_WIDTH     322
+
+static quint32 getTiffInt(const uchar *p, int size, bool big_endian)
+{
+    if (size==2)
+        return big_endian ? (p[0]<<8 | p[1]) : (p[1]<<8 | p[0]);
+    return big_endian ? (quint32(p[0])<<24 | p[1]<<16 | p[2]<<8 | p[3])
+                      : (quint32(p[3])<<24 | p[2]<<16 | p[1]<<8 | p[0]);
+}
+
+// read SHORT or LONG values of an IFD entry, which are in the entry if they fit
+static bool
+readTiffValues(QFile &file, const uchar *entry, bool big_endian, std::vector<quint32> &values)
+{
+    int type = getTiffInt(entry+2, 2, big_endian);
+    quint32 count = getTiffInt(entry+4, 4, big_endian);
+    int size = type==3 ? 2 : type==4 ? 4 : 0;
+    if (size==0 || count==0 || count > (1<<24))
+        return false;
+    std::vector<uchar> buf(count*size);
+    if (count*size <= 4)
+        memcpy(buf.data(), entry+8, count*size);
+    else if (not file.seek(getTiffInt(entry+8, 4, big_endian))
+            || file.read((char*)buf.data(), count*size)!=count*size)
+        return false;
+    values.resize(count);
+    for (quint32 i=0; i<count; i++)
+        values[i] = getTiffInt(buf.data() + i*size, size, big_endian);
+    return true;
+}
+
+static bool
+readTiffHeader(QFile &file, TiffInfo &info)
+{
+    uchar header[8];
+    if (file.read((char*)header, 8)!=8)
+        return false;
+    bool big_endian = header[0]=='M' && header[1]=='M';
+    if (not big_endian && not (header[0]=='I' && header[1]=='I'))
+        return false;
+    if (getTiffInt(header+2, 2, big_endian)!=42)
+        return false;
+    uchar count_buf[2];
+    if (not file.seek(getTiffInt(header+4, 4, big_endian)) || file.read((char*)count_buf, 2)!=2)
+        return false;
+    int entry_count = getTiffInt(count_buf, 2, big_endian);
+    std::vector<uchar> entries(entry_count*12);
+    if (file.read((char*)entries.data(), entries.size())!=(qint64)entries.size())
+        return false;
+
+    int bits = 1, compression = 1, photometric = -1, planar = 1;
+    info.width = info.height = 0;
+    info.channels = 1;
+    int rows_per_strip = 0;
+    std::vector<quint32> offsets, values;
+    for (int i=0; i<entry_count; i++)
+    {
+        const uchar *entry = entries.data() + i*12;
+        int tag = getTiffInt(entry, 2, big_endian);
+        switch (tag) {
+        case TIFF_WIDTH:
+        case TIFF_HEIGHT:
+        case TIFF_BITS:
+        case TIFF_COMPRESSION:
+        case TIFF_PHOTOMETRIC:
+        case TIFF_SAMPLES:
+        case TIFF_ROWS_PER_STRIP:
+        case TIFF_PLANAR:
+            if (not readTiffValues(file, entry, big_endian, values))
+                return false;
+            // all samples must have same bits
+            if (tag==TIFF_BITS && *std::max_element(values.begin(), values.end())!=values[0])
+                return false;
+            if (tag==TIFF_WIDTH) info.width = values[0];
+            else if (tag==TIFF_HEIGHT) info.height = values[0];
+            else if (tag==TIFF_BITS) bits = values[0];
+            else if (tag==TIFF_COMPRESSION) compression = values[0];
+            else if (tag==TIFF_PHOTOMETRIC) photometric = values[0];
+            else if (tag==TIFF_SAMPLES) info.channels = values[0];
+            else if (tag==TIFF_ROWS_PER_STRIP) rows_per_strip = std::min(values[0], 1u<<30);
+            else planar = values[0];
+            break;
+        case TIFF_STRIP_OFFSETS:
+            if (not readTiffValues(file, entry, big_endian, offsets))
+                return false;
+            break;
+        case TIFF_TILE_WIDTH:// tiled image
+            return false;
+        default:
+            break;
+        }
+    }
+    bool gray = photometric==1 && info.channels<=2;
+    bool rgb = photometric==2 && info.channels>=3;
+    if (info.width<=0 || info.height<=0 || bits!=8 || compression!=1 || planar!=1
+            || not (gray || rgb) || offsets.empty())
+        return false;
+    if (rows_per_strip<=0 || rows_per_strip>info.height)
+        rows_per_strip = info.height;
+    int strip_count = (info.height + rows_per_strip-1)/rows_per_strip;
+    if ((int)offsets.size() < strip_count)
+        return false;
+    int row_bytes = info.width*info.channels;
+    for (int i=0; i<strip_count; i++) {
+        int rows = std::min(rows_per_strip, info.height - i*rows_per_strip);
+        if (offsets[i] + qint64(rows)*row_bytes > file.size())
+            return false;
+        addStrips(info.strips, offsets[i], rows, row_bytes);
+    }
+    return true;
+}
+
+static void
+addHistogram(Histogram &hist, Histogram &other)
+{
+    for (int i=0; i<256; i++) {
+        hist.r[i] += other.r[i];
+        hist.g[i] += other.g[i];
+        hist.b[i] += other.b[i];
+        hist.y[i] += other.y[i];
+    }
+}
+
+// get histogram of an image file with bounded memory, returns false on failure
+bool getFileHistogram(QString filename, Histogram &hist, QSize &size)
+{
+    memset(&hist, 0, sizeof(Histogram));
+    QFile file(filename);
+    if (not file.open(QIODevice::ReadOnly))
+        return false;
+    PnmInfo info;
+    if (readPnmHeader(file, info)) {
+        file.close();
+        size = QSize(info.width, info.height);
+        return getPnmHistogram(filename, info, hist);
+    }
+    file.seek(0);
+
+    TiffInfo tiff;
+    if (readTiffHeader(file, tiff)) {
+        file.close();
+        size = QSize(tiff.width, tiff.height);
+        return getStripsHistogram(filename, tiff.strips, tiff.width, tiff.channels, hist);
+    }
+    file.seek(0);
+
+    QImageReader reader(&file);
+    size = reader.size();
+    if (size.isValid() && reader.supportsOption(QImageIOHandler::ClipRect))
+    {
+        int w = size.width();
+        int h = size.height();
+        int band_h = std::max(1, BAND_MEMORY/(4*w));
+        for (int y=0; y<h; y+=band_h) {
+            /* setting the device again resets the reader, so that it can read
+               again. The decoder still has to read the file from the start
+               upto the band, so bands are made as large as BAND_MEMORY allows */
+            file.seek(0);
+            reader.setDevice(&file);
+            reader.setClipRect(QRect(0, y, w, std::min(band_h, h-y)));
+            QImage band = reader.read();
+            if (band.isNull())
+                return false;
+            Histogram band_hist;
+            computeHistogram(band, band_hist);
+            addHistogram(hist, band_hist);
+        }
+        return true;
+    }
+    QImage img = reader.read();
+    if (img.isNull())
+        return false;
+    size = img.size();
+    computeHistogram(img, hist);
+    return true;
+}
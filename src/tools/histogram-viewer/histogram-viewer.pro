@@ -1,5 +1,6 @@
 HEADERS = histogram_viewer.h
-SOURCES = histogram_viewer.cpp
+SOURCES = histogram_viewer.cpp image_stats.cpp histogram_2d.cpp region_histogram.cpp \
+          file_histogram.cpp
 
 TARGET  = $$qtLibraryTarget(histogram-viewer)
 DESTDIR = ../..
@@ -7,9 +8,9 @@ INCLUDEPATH += $$DESTDIR
 
 TEMPLATE        = lib
 CONFIG         += plugin
-QMAKE_CXXFLAGS  = -std=c++11
+QMAKE_CXXFLAGS  = -std=c++11 -fopenmp
 QMAKE_LFLAGS   += -s
-LIBS           +=
+LIBS           += -lgomp
 
 QT += widgets
 
@@ -0,0 +1,136 @@
+/*  This file is a part of PhotoQuick Plugins project, and is GNU GPLv3 licensed
+    Copyright (C) 2020-2024 Arindam Chaudhuri <ksharindam@gmail.com>
+*/
+/* 2D histograms for spotting colour casts.
+   Chroma (Cb, Cr) histogram, like a vectorscope, and Hue x Saturation histogram.
+   Both are computed in one parallel pass, using integer colour transforms.
+*/
+#include "histogram_viewer.h"
+#include <cmath>
+#include <vector>
+
+// BT.601 full range chroma, weights in 16 bit fixed point
+#define CB_R -11058
+#define CB_G -21710
+#define CB_B  32768
+#define CR_R  32768
+#define CR_G -27439
+#define CR_B  -5329
+// 128 offset, the weights are such that result is always in 0-255 range
+#define CHROMA_OFFSET (128<<16)
+
+void computeHistogram2D(const QImage &img, uint hist_cbcr[], uint hist_hue_sat[])
+{
+    int w = img.width();
+    int h = img.height();
+    memset(hist_cbcr, 0, HIST2D_BINS*sizeof(uint));
+    memset(hist_hue_sat, 0, HIST2D_BINS*sizeof(uint));
+    // reciprocal table, to avoid division per pixel
+    uint recip[256];
+    recip[0] = 0;
+    for (int i=1; i<256; i++)
+        recip[i] = ((1<<16) + i-1)/i;
+    bool rgb32 = isRgb32Format(img);
+    int bands = (h + HISTOGRAM_BAND_ROWS-1)/HISTOGRAM_BAND_ROWS;
+
+    #pragma omp parallel
+    {
+        // each thread counts in its own bins
+        std::vector<uint> local_cbcr(HIST2D_BINS);
+        std::vector<uint> local_hue_sat(HIST2D_BINS);
+
+        #pragma omp for schedule(static)
+        for (int i=0; i<bands; i++)
+        {
+            // images in other formats are converted a band of rows at a time
+            int y0 = i*HISTOGRAM_BAND_ROWS;
+            int rows = qMin(HISTOGRAM_BAND_ROWS, h-y0);
+            QImage band = rgb32 ? img : img.copy(0, y0, w, rows).convertToFormat(QImage::Format_ARGB32);
+            int top = rgb32 ? y0 : 0;
+            for (int y=top; y<top+rows; y++)
+            {
+                const QRgb *row = (const QRgb*) band.constScanLine(y);
+                for (int x=0; x<w; x++)
+                {
+                    int r = qRed(row[x]);
+                    int g = qGreen(row[x]);
+                    int b = qBlue(row[x]);
+                    int cb = (CB_R*r + CB_G*g + CB_B*b + CHROMA_OFFSET) >> 16;
+                    int cr = (CR_R*r + CR_G*g + CR_B*b + CHROMA_OFFSET) >> 16;
+                    ++local_cbcr[(cr<<8) + cb];
+                    // HSV hue and saturation in 0-255 range
+                    int max = std::max(r, std::max(g, b));
+                    int min = std::min(r, std::min(g, b));
+                    int delta = max - min;
+                    int hue = 0;
+                    int sat = (255*delta*recip[max]) >> 16;
+                    if (delta) {
+                        if (max==r)
+                            hue = (43*(g-b)*(int)recip[delta]) >> 16;
+                        else if (max==g)
+                            hue = 85 + ((43*(b-r)*(int)recip[delta]) >> 16);
+                        else
+                            hue = 171 + ((43*(r-g)*(int)recip[delta]) >> 16);
+                        hue &= 255;
+                    }
+                    ++local_hue_sat[(sat<<8) + hue];
+                }
+            }
+        }
+        #pragma omp critical
+        {
+            for (int i=0; i<HIST2D_BINS; i++) {
+                hist_cbcr[i] += local_cbcr[i];
+                hist_hue_sat[i] += local_hue_sat[i];
+            }
+        }
+    }
+}
+
+/* draw a 2D histogram with outline, at (left, top) of image, in log scale.
+   x axis is the low index of bins, y axis is the high index growing upwards.
+   each bin is drawn in its own colour, brightness shows the count. */
+void drawHistogram2DPanel(QImage &img, int left, int top, uint histogram[], bool hue_sat)
+{
+    uint max_val = 0;
+    for (int i=0; i<HIST2D_BINS; i++) {
+        if (histogram[i] > max_val) max_val = histogram[i];
+    }
+    float factor = max_val>0 ? 1.0f/log(1.0f+max_val) : 0;
+    QRgb black = qRgb(0,0,0);
+    QRgb *row = (QRgb*)img.scanLine(top) + left;
+    QRgb *last_row = (QRgb*)img.scanLine(top+257) + left;
+    for (int x=0; x<258; x++) {
+        row[x] = black;
+        last_row[x] = black;
+    }
+    for (int j=0; j<256; j++)
+    {
+        row = (QRgb*)img.scanLine(top+256-j) + left;
+        row[0] = black;
+        row[257] = black;
+        for (int i=0; i<256; i++)
+        {
+            uint count = histogram[(j<<8) + i];
+            if (count==0) {
+                row[i+1] = black;
+                continue;
+            }
+            float val = 0.25f + 0.75f*factor*log(1.0f+count);
+            int r, g, b;
+            if (hue_sat) {
+                QColor clr = QColor::fromHsv(i*359/255, j, 255);
+                r = clr.red(); g = clr.green(); b = clr.blue();
+            }
+            else {// YCbCr to RGB, with Y=128
+                r = 128 + 1.402f*(j-128);
+                g = 128 - 0.344136f*(i-128) - 0.714136f*(j-128);
+                b = 128 + 1.772f*(i-128);
+            }
+            r = qBound(0, int(val*r), 255);
+            g = qBound(0, int(val*g), 255);
+            b = qBound(0, int(val*b), 255);
+            row[i+1] = qRgb(r,g,b);
+        }
+    }
+}
@@ -3,15 +3,20 @@
 */
 #include "histogram_viewer.h"
 #include <cmath>
-#include <QPainter>
+#include <vector>
 #include <QGridLayout>
 #include <QHBoxLayout>
-#include <QCheckBox>
 #include <QDialogButtonBox>
+#include <QPushButton>
+#include <QFileDialog>
+#include <QMessageBox>
+#include <QFileInfo>
+#include <QFile>
 
 
 #define PLUGIN_NAME "Histogram Viewer"
 #define PLUGIN_MENU "Info/Histogram Viewer"
+#define PLUGIN_MENU_FILE "Info/Histogram of Image File..."
 #define PLUGIN_VERSION "1.0"
 
 #if QT_VERSION < QT_VERSION_CHECK(5, 0, 0)
@@ -20,142 +25,292 @@
 
 //********* ---------- Histogram Viewer --------- ********** //
 
-void getHistogram(QImage &img, uint hist_r[], uint hist_g[], uint hist_b[], uint hist_y[])
-{
-    int w = img.width();
-    int h = img.height();
-
-    for (int y=0; y<h; y++) {
-        QRgb *row = (QRgb*) img.constScanLine(y);
-        for (int x=0; x<w; x++) {
-            int r = qRed(row[x]);
-            int g = qGreen(row[x]);
-            int b = qBlue(row[x]);
-            int Y = r*0.2126f + g*0.7152f + b*0.0722f;
-            ++hist_r[r];
-            ++hist_g[g];
-            ++hist_b[b];
-            ++hist_y[Y];
-        }
-    }
-}
+#define HIST_W 256
+#define HIST_H 160
 
+/* draw a histogram panel with outline and grid, at (left, top) of image.
+   bars are filled from bottom to top directly in image buffer.
+   panel size is (HIST_W+2)x(HIST_H+2) including outline */
 template<typename T>
-QImage histogramImage(T histogram[], QColor color, int hist_w, int hist_h)
+void drawHistogramPanel(QImage &img, int left, int top, T histogram[], QRgb color)
 {
     // get maximum in each histogram
     T max_val=0;
     for (int i=0; i<256; i++) {
         if (histogram[i] > max_val) max_val = histogram[i];
     }
-    // create histogram image and draw histogram
-    double factor = (double)hist_h / max_val;
-
-    QImage hist_img(hist_w+2, hist_h+2, QImage::Format_RGB32);
-    hist_img.fill(Qt::white);
-
-    QPainter painter(&hist_img);
-    // draw outline and grid
-    painter.drawRect(0,0, hist_w+1, hist_h+1);
-    painter.setPen(QColor(220,220,220));
-    for (int i=1; i<5; i++) {
-        painter.drawLine(QPoint(i*255/5,1), QPoint(i*255/5,hist_h));
+    double factor = max_val>0 ? (double)HIST_H / max_val : 0;
+    QRgb black = qRgb(0,0,0);
+    QRgb grid = qRgb(220,220,220);
+    // draw outline
+    QRgb *row = (QRgb*)img.scanLine(top) + left;
+    QRgb *last_row = (QRgb*)img.scanLine(top+HIST_H+1) + left;
+    for (int x=0; x<HIST_W+2; x++) {
+        row[x] = black;
+        last_row[x] = black;
+    }
+    for (int y=1; y<=HIST_H; y++) {
+        row = (QRgb*)img.scanLine(top+y) + left;
+        row[0] = black;
+        row[HIST_W+1] = black;
+        // draw grid
+        for (int i=1; i<5; i++)
+            row[i*255/5] = grid;
     }
     // draw histogram bars
-    painter.setPen(color);
+    int stride = img.bytesPerLine()/4;
+    QRgb *bottom = (QRgb*)img.scanLine(top+HIST_H) + left+1;
     for (int i=0; i<256; i++) {
-        int line_height = factor*histogram[i];
-        if (line_height==0)
-            continue;
-        QPoint start(i+1, 1);
-        QPoint end(i+1, line_height);
-        painter.drawLine(start, end);
+        int line_height = histogram[i]>0 ? factor*histogram[i] : 0;
+        QRgb *pixel = bottom + i;
+        for (int y=0; y<line_height; y++) {
+            *pixel = color;
+            pixel -= stride;
+        }
     }
-    painter.end();
-    // flip, because Y axis has reverse direction in QImage
-    QTransform tfm;
-    tfm.rotate(180, Qt::XAxis);
-    return hist_img.transformed(tfm);
 }
 
-
 //--------- **************** Histogram Dialog ****************---------
-HistogramDialog:: HistogramDialog(QWidget *parent, QImage &image) : QDialog(parent)
+HistogramDialog:: HistogramDialog(QWidget *parent, QImage &image) : QDialog(parent), image(image)
 {
     this->setWindowTitle("R G B and Luminance(Y) Histogram");
-    this->resize(540, 400);
+    setupUi();
+    // generate histograms
+    getImageHistogram(image, hist);
+    drawHistogram(false);
+    showStats();
+    setThumbnail();
+}
+
+static QImage null_image;
+
+// shows histogram of a file, there is no image to select region from
+HistogramDialog:: HistogramDialog(QWidget *parent, QString filename, Histogram &file_hist,
+                            QSize size) : QDialog(parent), image(null_image)
+{
+    this->setWindowTitle(QString("Histogram : %1").arg(QFileInfo(filename).fileName()));
+    setupUi();
+    this->filename = filename;
+    file_size = size;
+    hist = file_hist;
+    thumbnail->hide();
+    viewCombo->setEnabled(false);
+    drawHistogram(false);
+    showStats();
+}
+
+void
+HistogramDialog:: setupUi()
+{
+    this->resize(820, 400);
 
     QGridLayout *gridLayout = new QGridLayout(this);
 
     histLabel = new QLabel(this);
     histLabel->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
     gridLayout->addWidget(histLabel, 0, 0, 1, 2);
+
+    thumbnail = new RegionSelector(this);
+    thumbnail->setToolTip("Drag to select a region, click to clear selection");
+    gridLayout->addWidget(thumbnail, 0, 2, 1, 1, Qt::AlignTop);
+
+    statsLabel = new QLabel(this);
+    QFont font("Monospace");
+    font.setStyleHint(QFont::TypeWriter);
+    statsLabel->setFont(font);
+    statsLabel->setTextInteractionFlags(Qt::TextSelectableByMouse);
+    gridLayout->addWidget(statsLabel, 1, 0, 1, 2);
     // container for holding buttons
     QWidget *container = new QWidget(this);
-    gridLayout->addWidget(container, 1, 0, 1, 1);
+    gridLayout->addWidget(container, 2, 0, 1, 1);
 
     QDialogButtonBox *buttonBox = new QDialogButtonBox(Qt::Horizontal, this);
     buttonBox->setStandardButtons(QDialogButtonBox::Close);
-    gridLayout->addWidget(buttonBox, 1, 1, 1, 1);
+    QPushButton *saveStatsBtn = buttonBox->addButton("Save Statistics...", QDialogButtonBox::ActionRole);
+    gridLayout->addWidget(buttonBox, 2, 1, 1, 1);
 
     QHBoxLayout *hLayout = new QHBoxLayout(container);
     container->setLayout(hLayout);
 
-    QCheckBox *logBtn = new QCheckBox("Logarithmic", this);
+    viewCombo = new QComboBox(this);
+    viewCombo->addItems(QStringList({"RGB and Luminance", "Chroma and Hue-Saturation"}));
+    hLayout->addWidget(viewCombo);
+
+    logBtn = new QCheckBox("Logarithmic", this);
     hLayout->addWidget(logBtn);
 
+    connect(viewCombo, SIGNAL(currentIndexChanged(int)), this, SLOT(setView(int)));
     connect(logBtn, SIGNAL(clicked(bool)), this, SLOT(drawHistogram(bool)));
+    connect(saveStatsBtn, SIGNAL(clicked()), this, SLOT(saveStats()));
+    connect(thumbnail, SIGNAL(regionChanged(QRect)), this, SLOT(setRegion(QRect)));
     connect(buttonBox, SIGNAL(accepted()), this, SLOT(accept()));
     connect(buttonBox, SIGNAL(rejected()), this, SLOT(reject()));
+}
 
-    // generate histograms
-    getHistogram(image, hist_r, hist_g, hist_b, hist_y);
-    drawHistogram(false);
+void
+HistogramDialog:: setThumbnail()
+{
+    QImage thumb = image.scaled(256, 256, Qt::KeepAspectRatio);
+    thumb_scale = thumb.isNull() ? 1.0 : (float)image.width()/thumb.width();
+    thumbnail->setPixmap(QPixmap::fromImage(thumb));
+    thumbnail->setFixedSize(thumb.size());
 }
 
+/* the index is built once per image, then histogram of any region
+   is got with few lookups, while the selection is being dragged */
 void
-HistogramDialog:: drawHistogram(bool logarithmic)
+HistogramDialog:: setRegion(QRect rect)
+{
+    if (rect.isNull()) {
+        region = QRect();
+        getImageHistogram(image, hist);
+    }
+    else {
+        region = QRect(rect.x()*thumb_scale, rect.y()*thumb_scale,
+                    rect.width()*thumb_scale, rect.height()*thumb_scale);
+        if (region_index.image_key != image.cacheKey())
+            region_index.build(image);
+        region_index.query(image, region, hist);
+    }
+    linear_pixmap = QPixmap();
+    log_pixmap = QPixmap();
+    setView(viewCombo->currentIndex());
+    showStats();
+}
+
+// size of the image, file or selected region, whose histogram is shown
+QSize
+HistogramDialog:: statsSize()
+{
+    if (not filename.isEmpty())
+        return file_size;
+    if (not region.isNull())
+        return region.intersected(image.rect()).size();
+    return image.size();
+}
+
+// show statistics of each channel as a table
+void
+HistogramDialog:: showStats()
 {
-    int hist_w = 256;
-    int hist_h = 160;
-    QImage imgR, imgG, imgB, imgY;
+    ImageStats stats;
+    getHistogramStats(hist, statsSize(), stats);
+    const char *names[4] = {"R", "G", "B", "Y"};
+    QString text("   Mean  StdDev Min Max  P5 P50 P95 Entropy Shadows Highlights");
+    for (int c=0; c<4; c++) {
+        ChannelStats &ch = stats.channel[c];
+        text += QString("\n%1 %2 %3 %4 %5 %6 %7 %8 %9 %10 %11").arg(names[c])
+                .arg(ch.mean, 6, 'f', 1).arg(ch.std_dev, 7, 'f', 2)
+                .arg(ch.min, 3).arg(ch.max, 3)
+                .arg(ch.percentile[1], 3).arg(ch.percentile[3], 3).arg(ch.percentile[5], 3)
+                .arg(ch.entropy, 7, 'f', 3).arg(ch.shadows, 7).arg(ch.highlights, 10);
+    }
+    statsLabel->setText(text);
+}
+
+void
+HistogramDialog:: saveStats()
+{
+    QString filepath = QFileDialog::getSaveFileName(this, "Save Statistics", "stats.json",
+                                                    "JSON Files (*.json)");
+    if (filepath.isEmpty())
+        return;
+    ImageStats stats;
+    getHistogramStats(hist, statsSize(), stats);
+    QFile file(filepath);
+    if (not file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        QMessageBox::warning(this, "Error", "Could not save statistics");
+        return;
+    }
+    file.write(imageStatsToJson(stats).toUtf8());
+    file.close();
+}
+
+// render histograms of R, G, B and Y in a 2x2 grid
+void
+HistogramDialog:: renderHistogram(bool logarithmic)
+{
+    QImage &img = logarithmic ? log_img : linear_img;
+    img = QImage(HIST_W*2+3, HIST_H*2+3, QImage::Format_RGB32);
+    img.fill(Qt::white);
+    QRgb gray = qRgb(127,127,127);
     if (not logarithmic) {
-        imgR = histogramImage(hist_r, Qt::red, hist_w, hist_h);
-        imgG = histogramImage(hist_g, Qt::green, hist_w, hist_h);
-        imgB = histogramImage(hist_b, Qt::blue, hist_w, hist_h);
-        imgY = histogramImage(hist_y, QColor(127,127,127), hist_w, hist_h);
+        drawHistogramPanel(img, 0, 0, hist.r, qRgb(255,0,0));
+        drawHistogramPanel(img, HIST_W+1, 0, hist.g, qRgb(0,255,0));
+        drawHistogramPanel(img, 0, HIST_H+1, hist.b, qRgb(0,0,255));
+        drawHistogramPanel(img, HIST_W+1, HIST_H+1, hist.y, gray);
     }
     else { // logarithmic histograms
         double loghist[4][256] = {};
         for (int i=0; i<256; i++) {
-            loghist[0][i] = log(hist_r[i]);
-            loghist[1][i] = log(hist_g[i]);
-            loghist[2][i] = log(hist_b[i]);
-            loghist[3][i] = log(hist_y[i]);
+            loghist[0][i] = hist.r[i] ? log(hist.r[i]) : 0;
+            loghist[1][i] = hist.g[i] ? log(hist.g[i]) : 0;
+            loghist[2][i] = hist.b[i] ? log(hist.b[i]) : 0;
+            loghist[3][i] = hist.y[i] ? log(hist.y[i]) : 0;
         }
-        imgR = histogramImage(loghist[0], Qt::red, hist_w, hist_h);
-        imgG = histogramImage(loghist[1], Qt::green, hist_w, hist_h);
-        imgB = histogramImage(loghist[2], Qt::blue, hist_w, hist_h);
-        imgY = histogramImage(loghist[3], QColor(127,127,127), hist_w, hist_h);
+        drawHistogramPanel(img, 0, 0, loghist[0], qRgb(255,0,0));
+        drawHistogramPanel(img, HIST_W+1, 0, loghist[1], qRgb(0,255,0));
+        drawHistogramPanel(img, 0, HIST_H+1, loghist[2], qRgb(0,0,255));
+        drawHistogramPanel(img, HIST_W+1, HIST_H+1, loghist[3], gray);
     }
+}
 
-    QImage img(hist_w*2+3, hist_h*2+3, QImage::Format_RGB32);
-    img.fill(Qt::white);
-    QPainter painter(&img);
-    painter.drawImage(0, 0, imgR);
-    painter.drawImage(hist_w+1, 0, imgG);
-    painter.drawImage(0, hist_h+1, imgB);
-    painter.drawImage(hist_w+1, hist_h+1, imgY);
-    painter.end();
+/* render Cb-Cr (vectorscope) and Hue-Saturation histograms side by side.
+   it uses a separate pass, so it is computed only when this view is selected */
+void
+HistogramDialog:: renderHistogram2D()
+{
+    std::vector<uint> hist_cbcr(HIST2D_BINS);
+    std::vector<uint> hist_hue_sat(HIST2D_BINS);
+    computeHistogram2D(image, hist_cbcr.data(), hist_hue_sat.data());
+
+    hist2d_img = QImage(HIST_W*2+3, HIST_H*2+3, QImage::Format_RGB32);
+    hist2d_img.fill(Qt::white);
+    int top = (hist2d_img.height()-258)/2;
+    drawHistogram2DPanel(hist2d_img, 0, top, hist_cbcr.data(), false);
+    drawHistogram2DPanel(hist2d_img, 257, top, hist_hue_sat.data(), true);
+}
 
-    histLabel->setPixmap(QPixmap::fromImage(img));
+void
+HistogramDialog:: setView(int view)
+{
+    logBtn->setEnabled(view==0);
+    if (view==0) {
+        drawHistogram(logBtn->isChecked());
+        return;
+    }
+    if (hist2d_pixmap.isNull()) {
+        renderHistogram2D();
+        hist2d_pixmap = QPixmap::fromImage(hist2d_img);
+    }
+    histLabel->setPixmap(hist2d_pixmap);
+}
+
+// both linear and logarithmic renderings are cached, so toggling is instant
+void
+HistogramDialog:: drawHistogram(bool logarithmic)
+{
+    QPixmap &pm = logarithmic ? log_pixmap : linear_pixmap;
+    if (pm.isNull()) {
+        renderHistogram(logarithmic);
+        pm = QPixmap::fromImage(logarithmic ? log_img : linear_img);
+    }
+    histLabel->setPixmap(pm);
 }
 
 // ********* ----------- Plugin ---------- ********* //
 
-QString ToolPlugin:: menuItem()
+QStringList ToolPlugin:: menuItems()
+{
+    return QStringList({PLUGIN_MENU, PLUGIN_MENU_FILE});
+}
+
+void ToolPlugin:: handleAction(QAction *action, int /*type*/)
 {
-    return QString(PLUGIN_MENU);
+    if (action->text() == QString(PLUGIN_MENU_FILE).section('/', -1))
+        connect(action, SIGNAL(triggered()), this, SLOT(showFileHistogram()));
+    else
+        connect(action, SIGNAL(triggered()), this, SLOT(onMenuClick()));
 }
 
 void ToolPlugin:: onMenuClick()
@@ -163,3 +318,21 @@ void ToolPlugin:: onMenuClick()
     HistogramDialog *dlg = new HistogramDialog(data->window, data->image);
     dlg->exec();
 }
+
+// for very large scans, histogram is computed without loading whole image
+void ToolPlugin:: showFileHistogram()
+{
+    QString filefilter = "Image files (*.jpg *.png *.jpeg *.tif *.tiff *.ppm *.pgm);;All Files (*)";
+    QString filepath = QFileDialog::getOpenFileName(data->window, "Open Image", "", filefilter);
+    if (filepath.isEmpty())
+        return;
+    Histogram hist;
+    QSize size;
+    if (not getFileHistogram(filepath, hist, size)) {
+        emit sendNotification("Error", "Could not read image file");
+        return;
+    }
+    HistogramDialog *file_dlg = new HistogramDialog(data->window, filepath, hist, size);
+    file_dlg->setAttribute(Qt::WA_DeleteOnClose);
+    file_dlg->show();
+}
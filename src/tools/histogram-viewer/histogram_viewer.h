@@ -1,40 +1,144 @@
 #pragma once
 #include "plugin.h"
+#include "histogram.h"
 #include <QDialog>
 #include <QLabel>
+#include <QPixmap>
+#include <QCheckBox>
+#include <QComboBox>
+#include <QRubberBand>
+#include <vector>
 
-class ToolPlugin : public QObject, Plugin
-{
-    Q_OBJECT
-    Q_INTERFACES(Plugin)
-#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
-    Q_PLUGIN_METADATA(IID Plugin_iid)
-#endif
+// ********** Image Statistics *********
+#define PERCENTILE_COUNT 7
+
+extern const int stats_percentiles[PERCENTILE_COUNT];
+
+typedef struct {
+    double mean;
+    double std_dev;
+    int min;
+    int max;
+    int percentile[PERCENTILE_COUNT];
+    double entropy;
+    quint64 shadows;   // pixels clipped to 0
+    quint64 highlights;// pixels clipped to 255
+} ChannelStats;
+
+typedef struct {
+    int width;
+    int height;
+    ChannelStats channel[4];// R, G, B, Y
+} ImageStats;
+
+void getHistogramStats(Histogram &hist, QSize size, ImageStats &stats);
+void getImageStats(const QImage &img, ImageStats &stats);
+QString imageStatsToJson(const ImageStats &stats);
+bool writeImageStatsJson(const QImage &img, QString filename);
+bool writeFileStatsJson(QString image_filename, QString filename);
+
+// histogram of image file, without loading whole image in memory
+bool getFileHistogram(QString filename, Histogram &hist, QSize &size);
 
+// ********** 2D Histograms *********
+#define HIST2D_BINS (256*256)
+
+void computeHistogram2D(const QImage &img, uint hist_cbcr[], uint hist_hue_sat[]);
+void drawHistogram2DPanel(QImage &img, int left, int top, uint histogram[], bool hue_sat);
+
+// ********** Region Histogram *********
+// Default memory limit of region histogram index
+#define INDEX_MAX_MEMORY (64*1024*1024)
+
+class HistogramIndex
+{
 public:
-    QString menuItem();
+    int tile_size = 0;
+    int tiles_x = 0;
+    int tiles_y = 0;
+    qint64 image_key = 0;// image for which the index was built
+    std::vector<uint> bins;// cumulative histograms at tile corners
 
-public slots:
-    void onMenuClick();
+    void build(const QImage &img, size_t max_memory=INDEX_MAX_MEMORY);
+    void query(const QImage &img, QRect rect, Histogram &hist);
+    uint* corner(int tx, int ty) { return bins.data() + (ty*(tiles_x+1) + tx)*sizeof(Histogram)/sizeof(uint); }
+};
+
+// shows a thumbnail of image, where a region can be selected by dragging mouse
+class RegionSelector : public QLabel
+{
+    Q_OBJECT
+public:
+    QPoint start_pos;
+    QRubberBand *rubberBand;
 
+    RegionSelector(QWidget *parent);
+    void mousePressEvent(QMouseEvent *ev);
+    void mouseMoveEvent(QMouseEvent *ev);
+    void mouseReleaseEvent(QMouseEvent *ev);
 signals:
-    void imageChanged();
-    void optimumSizeRequested();
-    void sendNotification(QString title, QString message);
+    void regionChanged(QRect);// in thumbnail coordinates, null if cleared
 };
 
+
 class HistogramDialog : public QDialog
 {
     Q_OBJECT
 public:
-    uint hist_r[256] = {};
-    uint hist_g[256] = {};
-    uint hist_b[256] = {};
-    uint hist_y[256] = {};
+    QImage &image;
+    QString filename;// histogram of a file which is not loaded
+    QSize file_size;
+    Histogram hist;
+    HistogramIndex region_index;
+    QRect region;// selected region, null for whole image
+    float thumb_scale;// image size / thumbnail size
+    // rendered histograms
+    QImage linear_img;
+    QImage log_img;
+    QPixmap linear_pixmap;
+    QPixmap log_pixmap;
+    QImage hist2d_img;
+    QPixmap hist2d_pixmap;
     //widgets
     QLabel *histLabel;
+    RegionSelector *thumbnail;
+    QComboBox *viewCombo;
+    QCheckBox *logBtn;
+    QLabel *statsLabel;
 
     HistogramDialog(QWidget *parent, QImage &image);
+    HistogramDialog(QWidget *parent, QString filename, Histogram &file_hist, QSize size);
+    void setupUi();
+    void renderHistogram(bool logarithmic);
+    void renderHistogram2D();
+    void setThumbnail();
+    void showStats();
+    QSize statsSize();
 public slots:
     void drawHistogram(bool logarithmic);
+    void setView(int view);
+    void setRegion(QRect rect);
+    void saveStats();
+};
+
+class ToolPlugin : public QObject, Plugin
+{
+    Q_OBJECT
+    Q_INTERFACES(Plugin)
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    Q_PLUGIN_METADATA(IID Plugin_iid)
+#endif
+
+public:
+    QStringList menuItems();
+    void handleAction(QAction *action, int type);
+
+public slots:
+    void onMenuClick();
+    void showFileHistogram();
+
+signals:
+    void imageChanged();
+    void optimumSizeRequested();
+    void sendNotification(QString title, QString message);
 };
@@ -0,0 +1,129 @@
+/*  This file is a part of PhotoQuick Plugins project, and is GNU GPLv3 licensed
+    Copyright (C) 2020-2024 Arindam Chaudhuri <ksharindam@gmail.com>
+*/
+/* Image statistics for quality check.
+   All statistics are derived from the 256 bin histograms, so the image is
+   read only once (in parallel), or not at all if histogram is cached.
+*/
+#include "histogram_viewer.h"
+#include <cmath>
+#include <QFile>
+
+const int stats_percentiles[PERCENTILE_COUNT] = {1, 5, 25, 50, 75, 95, 99};
+
+static void
+getChannelStats(uint histogram[], ChannelStats &stats)
+{
+    quint64 total = 0;
+    double sum = 0, sum_sq = 0;
+    stats.min = -1;
+    stats.max = -1;
+    for (int i=0; i<256; i++) {
+        if (histogram[i]==0)
+            continue;
+        if (stats.min<0) stats.min = i;
+        stats.max = i;
+        total += histogram[i];
+        sum += (double)histogram[i] * i;
+        sum_sq += (double)histogram[i] * i*i;
+    }
+    stats.shadows = histogram[0];
+    stats.highlights = histogram[255];
+    if (total==0) {
+        memset(&stats, 0, sizeof(ChannelStats));
+        return;
+    }
+    stats.mean = sum/total;
+    stats.std_dev = sqrt(std::max(sum_sq/total - stats.mean*stats.mean, 0.0));
+    // percentile is the lowest value below which at least p% of pixels lie
+    quint64 count = 0;
+    for (int i=0, p=0; i<256 && p<PERCENTILE_COUNT; i++) {
+        count += histogram[i];
+        while (p<PERCENTILE_COUNT && 100*count >= stats_percentiles[p]*total) {
+            stats.percentile[p++] = i;
+        }
+    }
+    // Shannon entropy in bits
+    stats.entropy = 0;
+    for (int i=0; i<256; i++) {
+        if (histogram[i]==0)
+            continue;
+        double prob = (double)histogram[i]/total;
+        stats.entropy -= prob * log2(prob);
+    }
+}
+
+void getHistogramStats(Histogram &hist, QSize size, ImageStats &stats)
+{
+    stats.width = size.width();
+    stats.height = size.height();
+    getChannelStats(hist.r, stats.channel[0]);
+    getChannelStats(hist.g, stats.channel[1]);
+    getChannelStats(hist.b, stats.channel[2]);
+    getChannelStats(hist.y, stats.channel[3]);
+}
+
+void getImageStats(const QImage &img, ImageStats &stats)
+{
+    Histogram hist;
+    getImageHistogram(img, hist);
+    getHistogramStats(hist, img.size(), stats);
+}
+
+static const char *channel_names[4] = {"red", "green", "blue", "luminance"};
+
+QString imageStatsToJson(const ImageStats &stats)
+{
+    QString json = QString("{\n  \"width\": %1,\n  \"height\": %2,\n  \"channels\": {\n")
+                            .arg(stats.width).arg(stats.height);
+    for (int c=0; c<4; c++) {
+        const ChannelStats &ch = stats.channel[c];
+        QString percentiles;
+        for (int p=0; p<PERCENTILE_COUNT; p++) {
+            percentiles += QString("\"p%1\": %2").arg(stats_percentiles[p]).arg(ch.percentile[p]);
+            if (p<PERCENTILE_COUNT-1)
+                percentiles += ", ";
+        }
+        json += QString("    \"%1\": {\n").arg(channel_names[c]);
+        json += QString("      \"mean\": %1,\n").arg(ch.mean, 0, 'f', 3);
+        json += QString("      \"std_dev\": %1,\n").arg(ch.std_dev, 0, 'f', 3);
+        json += QString("      \"min\": %1,\n      \"max\": %2,\n").arg(ch.min).arg(ch.max);
+        json += QString("      \"percentiles\": {%1},\n").arg(percentiles);
+        json += QString("      \"entropy\": %1,\n").arg(ch.entropy, 0, 'f', 4);
+        json += QString("      \"clipped_shadows\": %1,\n").arg(ch.shadows);
+        json += QString("      \"clipped_highlights\": %1\n").arg(ch.highlights);
+        json += QString("    }%1\n").arg(c<3 ? "," : "");
+    }
+    json += "  }\n}\n";
+    return json;
+}
+
+// headless function for batch quality check
+bool writeImageStatsJson(const QImage &img, QString filename)
+{
+    ImageStats stats;
+    getImageStats(img, stats);
+    QFile file(filename);
+    if (not file.open(QIODevice::WriteOnly | QIODevice::Text))
+        return false;
+    file.write(imageStatsToJson(stats).toUtf8());
+    file.close();
+    return true;
+}
+
+// same as above, but the image file is not loaded in memory
+bool writeFileStatsJson(QString image_filename, QString filename)
+{
+    Histogram hist;
+    QSize size;
+    if (not getFileHistogram(image_filename, hist, size))
+        return false;
+    ImageStats stats;
+    getHistogramStats(hist, size, stats);
+    QFile file(filename);
+    if (not file.open(QIODevice::WriteOnly | QIODevice::Text))
+        return false;
+    file.write(imageStatsToJson(stats).toUtf8());
+    file.close();
+    return true;
+}
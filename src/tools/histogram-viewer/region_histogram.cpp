@@ -0,0 +1,154 @@
+/*  This file is a part of PhotoQuick Plugins project, and is GNU GPLv3 licensed
+    Copyright (C) 2020-2024 Arindam Chaudhuri <ksharindam@gmail.com>
+*/
+/* Integral histogram index, to get histogram of any rectangle of image
+   without scanning the whole rectangle.
+   Image is divided into square tiles, and for each tile corner the histogram
+   of all pixels above and left of it is stored. Histogram of the tile
+   aligned part of a rectangle is then got from four lookups, and only the
+   pixels in the strips at the edges of the rectangle are counted.
+*/
+#include "histogram_viewer.h"
+#include <QMouseEvent>
+
+#define HIST_BINS (sizeof(Histogram)/sizeof(uint))
+
+// add histograms of pixels in a rectangle
+static void
+addRegionHistogram(const QImage &img, QRect rect, Histogram &hist)
+{
+    if (rect.isEmpty())
+        return;
+    Histogram region_hist;
+    computeHistogram(img, rect, region_hist);
+    uint *dst = (uint*)&hist;
+    uint *src = (uint*)&region_hist;
+    for (uint i=0; i<HIST_BINS; i++)
+        dst[i] += src[i];
+}
+
+/* tile size is chosen as the smallest power of two (min 16), for which
+   the index fits within max_memory bytes */
+void
+HistogramIndex:: build(const QImage &img, size_t max_memory)
+{
+    int w = img.width();
+    int h = img.height();
+    tile_size = 16;
+    while (true) {
+        tiles_x = (w+tile_size-1)/tile_size;
+        tiles_y = (h+tile_size-1)/tile_size;
+        size_t mem = size_t(tiles_x+1)*(tiles_y+1)*sizeof(Histogram);
+        if (mem <= max_memory || (tiles_x<=1 && tiles_y<=1))
+            break;
+        tile_size *= 2;
+    }
+    // only complete tiles are indexed, partial tiles at right and bottom are scanned
+    tiles_x = w/tile_size;
+    tiles_y = h/tile_size;
+    bins.assign(size_t(tiles_x+1)*(tiles_y+1)*HIST_BINS, 0);
+
+    // histogram of each tile, stored at its bottom right corner
+    bool rgb32 = isRgb32Format(img);
+    #pragma omp parallel for schedule(dynamic)
+    for (int ty=0; ty<tiles_y; ty++) {
+        // images in other formats are converted one row of tiles at a time
+        QImage band = rgb32 ? img : img.copy(0, ty*tile_size, w, tile_size)
+                                        .convertToFormat(QImage::Format_ARGB32);
+        int top = rgb32 ? ty*tile_size : 0;
+        for (int tx=0; tx<tiles_x; tx++) {
+            uint *tile_hist = corner(tx+1, ty+1);
+            Histogram &hist = *(Histogram*)tile_hist;
+            for (int y=top; y<top+tile_size; y++) {
+                const QRgb *row = (const QRgb*)band.constScanLine(y);
+                countHistogramRow(row + tx*tile_size, tile_size, hist);
+            }
+        }
+    }
+    // cumulative along rows, then along columns
+    #pragma omp parallel for
+    for (int ty=1; ty<=tiles_y; ty++) {
+        for (int tx=2; tx<=tiles_x; tx++) {
+            uint *left = corner(tx-1, ty);
+            uint *curr = corner(tx, ty);
+            for (uint i=0; i<HIST_BINS; i++)
+                curr[i] += left[i];
+        }
+    }
+    #pragma omp parallel for
+    for (int tx=1; tx<=tiles_x; tx++) {
+        for (int ty=2; ty<=tiles_y; ty++) {
+            uint *above = corner(tx, ty-1);
+            uint *curr = corner(tx, ty);
+            for (uint i=0; i<HIST_BINS; i++)
+                curr[i] += above[i];
+        }
+    }
+    image_key = img.cacheKey();
+}
+
+void
+HistogramIndex:: query(const QImage &img, QRect rect, Histogram &hist)
+{
+    rect = rect.intersected(img.rect());
+    memset(&hist, 0, sizeof(Histogram));
+    int x0 = rect.x(), x1 = rect.x() + rect.width();
+    int y0 = rect.y(), y1 = rect.y() + rect.height();
+    // tile aligned part of rectangle
+    int tx0 = (x0+tile_size-1)/tile_size, tx1 = std::min(x1/tile_size, tiles_x);
+    int ty0 = (y0+tile_size-1)/tile_size, ty1 = std::min(y1/tile_size, tiles_y);
+    if (tx0>=tx1 || ty0>=ty1) {
+        addRegionHistogram(img, rect, hist);
+        return;
+    }
+    uint *a = corner(tx0, ty0);
+    uint *b = corner(tx1, ty0);
+    uint *c = corner(tx0, ty1);
+    uint *d = corner(tx1, ty1);
+    uint *dst = (uint*)&hist;
+    for (uint i=0; i<HIST_BINS; i++)
+        dst[i] = d[i] - b[i] - c[i] + a[i];
+    // edge strips
+    int ax0 = tx0*tile_size, ax1 = tx1*tile_size;
+    int ay0 = ty0*tile_size, ay1 = ty1*tile_size;
+    addRegionHistogram(img, QRect(x0, y0, x1-x0, ay0-y0), hist); // top
+    addRegionHistogram(img, QRect(x0, ay1, x1-x0, y1-ay1), hist); // bottom
+    addRegionHistogram(img, QRect(x0, ay0, ax0-x0, ay1-ay0), hist); // left
+    addRegionHistogram(img, QRect(ax1, ay0, x1-ax1, ay1-ay0), hist); // right
+}
+
+
+// ************* Region Selector *************
+RegionSelector:: RegionSelector(QWidget *parent) : QLabel(parent)
+{
+    rubberBand = new QRubberBand(QRubberBand::Rectangle, this);
+    setCursor(Qt::CrossCursor);
+}
+
+void
+RegionSelector:: mousePressEvent(QMouseEvent *ev)
+{
+    start_pos = ev->pos();
+    rubberBand->setGeometry(QRect(start_pos, start_pos));
+    rubberBand->show();
+}
+
+void
+RegionSelector:: mouseMoveEvent(QMouseEvent *ev)
+{
+    QRect rect = QRect(start_pos, ev->pos()).normalized();
+    rubberBand->setGeometry(rect);
+    emit regionChanged(rect);
+}
+
+// a click without dragging clears the selection
+void
+RegionSelector:: mouseReleaseEvent(QMouseEvent *ev)
+{
+    QRect rect = QRect(start_pos, ev->pos()).normalized();
+    if (rect.width()<2 || rect.height()<2) {
+        rubberBand->hide();
+        rect = QRect();
+    }
+    emit regionChanged(rect);
+}